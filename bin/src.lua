@@ -0,0 +1,44 @@
+print(4)
+print(10)
+print(13)
+print(13)
+print(91.0)
+print(91.0)
+print(83.0)
+print(83.0)
+print(1253.0)
+print(1253.0)
+print(-2)
+print(-10)
+print(7)
+print(-7)
+print(-71.0)
+print(71.0)
+print(77.0)
+print(-77.0)
+print(1247.0)
+print(-1247.0)
+print(2)
+print(-10)
+print(-7)
+print(-7)
+print(10.012345679012345)
+print(71.0)
+print(-77.0)
+print(3.3125)
+print(-1247.0)
+print(-1247.0)
+print(-7)
+print(7)
+print(71.0)
+print(-71.0)
+print(3.3125)
+print(-77.0)
+print(-1247.0)
+print(3.0032)
+print(71.0)
+print(10.012345679012345)
+print(-77.0)
+print(77.0)
+print(3.0032)
+print(1247.0)
@@ -0,0 +1,70 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Instantiates a new Buffer object with some initial max capacity
+  The buffer's data is always null-terminated
+*/
+Buffer* new_buffer(int max){
+  Buffer* b=(Buffer*)malloc(sizeof(Buffer));
+  b->data=(char*)malloc(sizeof(char)*(max+1));
+  b->data[0]=0;
+  b->max=max;
+  b->n=0;
+  return b;
+}
+
+/*
+  Instantiates a Buffer with the default initial max capacity
+*/
+Buffer* new_default_buffer(){
+  return new_buffer(256);
+}
+
+/*
+  Appends l bytes of str to a buffer
+  Doubles the max length of the buffer until the bytes fit
+*/
+void append_to_buffer(Buffer* b,const char* str,int l){
+  if(b->n+l>b->max){
+    while(b->n+l>b->max) b->max*=2;
+    b->data=(char*)realloc(b->data,sizeof(char)*(b->max+1));
+  }
+  memcpy(b->data+b->n,str,l);
+  b->n+=l;
+  b->data[b->n]=0;
+}
+
+/*
+  Appends a null-terminated string to a buffer
+*/
+void append_string_to_buffer(Buffer* b,const char* str){
+  append_to_buffer(b,str,strlen(str));
+}
+
+/*
+  Writes a buffer's contents to a stream in a single call and empties the buffer
+*/
+void flush_buffer(Buffer* b,FILE* f){
+  if(b->n && f) fwrite(b->data,sizeof(char),b->n,f);
+  b->data[0]=0;
+  b->n=0;
+}
+
+/*
+  Deallocates a buffer and returns its contents as a string
+*/
+char* collapse_buffer(Buffer* b){
+  char* str=b->data;
+  free(b);
+  return str;
+}
+
+/*
+  Deallocates a buffer and its contents
+*/
+void dealloc_buffer(Buffer* b){
+  free(b->data);
+  free(b);
+}
@@ -35,34 +35,91 @@ FunctionNode* get_constructor(ClassNode* data){
 }
 
 /*
-  Returns a list of all fields given a AST_CLASS or AST_INTERFACE node
-  The returned list is full of AstNodes
+  Adds a member declared by some class or interface to a member table
+  Members that are already in the table take priority over new ones
 */
-List* get_all_expected_fields(AstNode* node){
-  List* ls=new_default_list();
-  if(node->type==AST_CLASS){
-    ClassNode* clas=(ClassNode*)(node->data);
-    append_all(ls,clas->ls);
-    for(int a=0;a<clas->interfaces->n;a++){
-      InterfaceNode* inter=interface_exists((char*)get_from_list(clas->interfaces,a));
-      AstNode* node1=new_node(AST_INTERFACE,-1,inter);
-      append_all(ls,get_all_expected_fields(node1));
-      free(node1);
-    }
-    clas=class_exists(clas->parent);
-    if(clas){
-      AstNode* node1=new_node(AST_CLASS,-1,clas);
-      append_all(ls,get_all_expected_fields(node1));
-      free(node1);
-    }
-  }else if(node->type==AST_INTERFACE){
-    InterfaceNode* inter=(InterfaceNode*)(node->data);
-    while(inter){
-      append_all(ls,inter->ls);
-      inter=interface_exists(inter->parent);
-    }
+static void add_member(Map* m,void* entity,AstNode* node){
+  char* name;
+  if(node->type==AST_FUNCTION){
+    FunctionNode* func=(FunctionNode*)(node->data);
+    if(!func->name) return;
+    name=(char*)(func->name->data);
+  }else{
+    name=((BinaryNode*)(node->data))->text;
   }
-  return ls;
+  if(get_from_map(m,name)) return;
+  MemberNode* member=(MemberNode*)malloc(sizeof(MemberNode));
+  member->type=(node->type==AST_FUNCTION)?get_type(node):((BinaryNode*)(node->data))->l;
+  member->kind=node->type;
+  member->entity=entity;
+  member->node=node;
+  put_in_map(m,name,member);
+}
+
+/*
+  Copies every member of an ancestor's table that isn't already in a member table
+*/
+static void inherit_members(Map* m,Map* ancestor){
+  for(int a=0;a<ancestor->n;a++){
+    if(get_from_map(m,ancestor->data[a].k)) continue;
+    MemberNode* member=(MemberNode*)malloc(sizeof(MemberNode));
+    *member=*((MemberNode*)iterate_from_map(ancestor,a));
+    put_in_map(m,ancestor->data[a].k,member);
+  }
+}
+
+/*
+  Returns the member table of an interface (a Map of names to MemberNodes)
+  Includes every method from the interface's ancestors
+  Built once and kept until the interface is deallocated
+*/
+Map* get_interface_members(InterfaceNode* node){
+  if(node->members) return node->members;
+  Map* m=new_default_map();
+  for(int a=0;a<node->ls->n;a++) add_member(m,node,(AstNode*)get_from_list(node->ls,a));
+  InterfaceNode* parent=interface_exists(node->parent);
+  if(parent) inherit_members(m,get_interface_members(parent));
+  node->members=m;
+  return m;
+}
+
+/*
+  Returns the member table of a class (a Map of names to MemberNodes)
+  Members are looked up in the class, then its interfaces, then its parent class
+  Built once and kept until the class is deallocated
+*/
+Map* get_class_members(ClassNode* node){
+  if(node->members) return node->members;
+  Map* m=new_default_map();
+  for(int a=0;a<node->ls->n;a++) add_member(m,node,(AstNode*)get_from_list(node->ls,a));
+  for(int a=0;a<node->interfaces->n;a++){
+    InterfaceNode* inter=interface_exists((char*)get_from_list(node->interfaces,a));
+    if(inter) inherit_members(m,get_interface_members(inter));
+  }
+  ClassNode* parent=class_exists(node->parent);
+  if(parent) inherit_members(m,get_class_members(parent));
+  node->members=m;
+  return m;
+}
+
+/*
+  Builds the member tables of every class and interface in a List of AstNodes
+  Called once the relate step has registered every entity in a scope
+*/
+void index_entity_members(List* ls){
+  for(int a=0;a<ls->n;a++){
+    AstNode* node=(AstNode*)get_from_list(ls,a);
+    if(node->type==AST_CLASS) get_class_members((ClassNode*)(node->data));
+    if(node->type==AST_INTERFACE) get_interface_members((InterfaceNode*)(node->data));
+  }
+}
+
+/*
+  Deallocates a member table and its MemberNodes
+*/
+void dealloc_members(Map* members){
+  for(int a=0;a<members->n;a++) free(iterate_from_map(members,a));
+  dealloc_map(members);
 }
 
 /*
@@ -75,7 +132,7 @@ static List* get_interface_ancestor_methods(AstNode* node){
   List* ls=new_default_list();
   if(node->type==AST_CLASS){
     ClassNode* c=(ClassNode*)(node->data);
-    AstNode* inode=new_node(AST_INTERFACE,-1,NULL);
+    AstNode* inode=new_node(AST_INTERFACE,-1,-1,NULL);
     while(c){
       for(int a=0;a<c->interfaces->n;a++){
         name=(char*)get_from_list(c->interfaces,a);
@@ -102,43 +159,78 @@ static List* get_interface_ancestor_methods(AstNode* node){
 /*
   Collects every method from a class and its class ancestors
   Just goes back through parent classes in a straight path
+  Returns a Map of method names to Lists of FunctionNodes
 */
-static List* get_class_ancestor_methods(ClassNode* node){
-  List* ls=new_default_list();
+static Map* get_class_ancestor_methods(ClassNode* node){
+  Map* m=new_default_map();
   while(node){
     for(int a=0;a<node->ls->n;a++){
       AstNode* e=(AstNode*)get_from_list(node->ls,a);
-      if(e->type==AST_FUNCTION) add_to_list(ls,e->data);
+      if(e->type!=AST_FUNCTION) continue;
+      FunctionNode* func=(FunctionNode*)(e->data);
+      if(!func->name) continue;
+      List* ls=(List*)get_from_map(m,(char*)(func->name->data));
+      if(!ls){
+        ls=new_default_list();
+        put_in_map(m,(char*)(func->name->data),ls);
+      }
+      add_to_list(ls,func);
     }
     node=class_exists(node->parent);
   }
-  return ls;
+  return m;
+}
+
+/*
+  Returns a method's signature, its name followed by its canonical function type
+  Two methods with the same signature are always equivalent
+*/
+static char* method_signature(FunctionNode* func){
+  char* name=(char*)(func->name->data);
+  char* signature=(char*)malloc(sizeof(char)*(strlen(name)+20));
+  sprintf(signature,"%s:%p",name,(void*)get_function_type(func));
+  return signature;
 }
 
 /*
   Retrieves all the ancestor methods from a class's ancestor classes and interfaces
   Then subtracts the two lists, returning any missing implementations in a List
+  Exact signatures are found with a single lookup, and only methods that share
+  a name but not a type fall back to a subtype-aware comparison
 */
 List* get_missing_class_methods(ClassNode* c){
-  AstNode* node=new_node(AST_CLASS,-1,c);
-  List* missing=get_interface_ancestor_methods(node);
-  List* found=get_class_ancestor_methods(c);
+  AstNode* node=new_node(AST_CLASS,-1,-1,c);
+  List* expected=get_interface_ancestor_methods(node);
+  Map* found=get_class_ancestor_methods(c);
+  Map* signatures=new_default_map();
+  List* missing=new_default_list();
   free(node);
-  int a=0;
-  while(a<missing->n){
-    int removed=0;
-    for(int b=0;b<found->n;b++){
-      FunctionNode* f1=(FunctionNode*)get_from_list(missing,a);
-      FunctionNode* f2=(FunctionNode*)get_from_list(found,b);
-      if(methods_equivalent(f1,f2)){
-        remove_from_list(missing,a);
-        removed=1;
-        break;
-      }
+  for(int a=0;a<found->n;a++){
+    List* ls=(List*)iterate_from_map(found,a);
+    for(int b=0;b<ls->n;b++){
+      FunctionNode* func=(FunctionNode*)get_from_list(ls,b);
+      char* signature=method_signature(func);
+      if(get_from_map(signatures,signature)) free(signature);
+      else put_in_map(signatures,signature,func);
+    }
+  }
+  for(int a=0;a<expected->n;a++){
+    FunctionNode* f1=(FunctionNode*)get_from_list(expected,a);
+    if(!f1->name) continue;
+    char* signature=method_signature(f1);
+    int implemented=(get_from_map(signatures,signature)!=NULL);
+    free(signature);
+    List* ls=(List*)get_from_map(found,(char*)(f1->name->data));
+    for(int b=0;ls && b<ls->n && !implemented;b++){
+      implemented=methods_equivalent(f1,(FunctionNode*)get_from_list(ls,b));
     }
-    if(!removed) a++;
+    if(!implemented) add_to_list(missing,f1);
   }
-  dealloc_list(found);
+  for(int a=0;a<signatures->n;a++) free(signatures->data[a].k);
+  for(int a=0;a<found->n;a++) dealloc_list((List*)iterate_from_map(found,a));
+  dealloc_map(signatures);
+  dealloc_map(found);
+  dealloc_list(expected);
   return missing;
 }
 
@@ -150,13 +242,8 @@ int methods_equivalent(FunctionNode* f1,FunctionNode* f2){
   if(!f1->name || !f2->name) return 0;
   assert(f1->name->type==AST_ID); // Assumes the two methods belong to classes (name nodes are of type AST_ID)
   assert(f2->name->type==AST_ID); // Assumes the two methods belong to classes (name nodes are of type AST_ID)
-  AstNode* node=new_node(AST_FUNCTION,-1,f1);
-  AstNode* type1=get_type(node);
-  free(node);
-  node=new_node(AST_FUNCTION,-1,f2);
-  AstNode* type2=get_type(node);
-  free(node);
-  return !strcmp((char*)(f1->name->data),(char*)(f2->name->data)) && typed_match(type1,type2);
+  if(strcmp((char*)(f1->name->data),(char*)(f2->name->data))) return 0;
+  return typed_match(get_function_type(f1),get_function_type(f2));
 }
 
 /*
@@ -204,6 +291,31 @@ Map* collapse_ancestor_class_fields(List* ls){
   return m;
 }
 
+/*
+  Returns the cached layout of a class
+  The layout is computed the first time it's needed and shared by every later pass
+*/
+ClassLayout* get_class_layout(ClassNode* node){
+  if(node->layout) return node->layout;
+  ClassLayout* layout=(ClassLayout*)malloc(sizeof(ClassLayout));
+  List* all_fields=get_all_class_fields(node);
+  layout->fields=collapse_ancestor_class_fields(all_fields);
+  layout->missing=get_missing_class_methods(node);
+  layout->constructor=get_constructor(node);
+  dealloc_list(all_fields);
+  node->layout=layout;
+  return layout;
+}
+
+/*
+  Deallocates a class layout
+*/
+void dealloc_class_layout(ClassLayout* layout){
+  if(layout->fields) dealloc_map(layout->fields);
+  dealloc_list(layout->missing);
+  free(layout);
+}
+
 /*
   Grabs the FunctionNode that corresponds to the child class's function
   clas should be the parent of the class who has the function method
@@ -222,11 +334,7 @@ FunctionNode* get_parent_method(ClassNode* clas,FunctionNode* method){
         assert(method->name->type==AST_ID); // I'm assuming both method->name and func->name are AST_ID types
         assert(func->name->type==AST_ID); // I'm assuming both method->name and func->name are AST_ID types
         if(strcmp((char*)(method->name->data),(char*)(func->name->data))) continue;
-        AstNode* func_type=get_type(e);
-        AstNode* m=new_node(AST_FUNCTION,-1,method);
-        AstNode* method_type=get_type(m);
-        free(m);
-        if(typed_match(func_type,method_type)){
+        if(typed_match(get_function_type(func),get_function_type(method))){
           return func;
         }
       }
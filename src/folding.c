@@ -0,0 +1,393 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+enum CONSTANT_KINDS{
+  CONSTANT_NIL, CONSTANT_BOOL, CONSTANT_INT, CONSTANT_FLOAT, CONSTANT_STRING
+};
+
+/*
+  A constant Lua value computed at compile time
+  Strings keep their quotes and never contain escape sequences
+*/
+typedef struct{
+  const char* s;
+  long long i;
+  double f;
+  int kind;
+} Constant;
+
+/*
+  A local variable whose value might be propagated to where it is read
+*/
+typedef struct{
+  AstNode* define;
+  List* reads; // AST_ID nodes that read the variable
+  int reassigned;
+  int folding; // 1 while the variable's value is being folded, so a cycle of reads stops folding
+  char* key;
+} Candidate;
+
+static Map* candidates; // Candidates keyed by the address of their name in the AST
+static List* candidates_list; // Every Candidate so they can be deallocated
+static List* folded; // Every folded text so it can be deallocated
+
+/*
+  Initializes this module
+*/
+void init_folding(){
+  candidates=new_default_map();
+  candidates_list=new_default_list();
+  folded=new_default_list();
+}
+
+/*
+  Deallocates data used by this module
+*/
+void dealloc_folding(){
+  for(int a=0;a<candidates_list->n;a++){
+    Candidate* c=(Candidate*)get_from_list(candidates_list,a);
+    dealloc_list(c->reads);
+    free(c->key);
+    free(c);
+  }
+  for(int a=0;a<folded->n;a++) free(get_from_list(folded,a));
+  dealloc_list(candidates_list);
+  dealloc_map(candidates);
+  dealloc_list(folded);
+}
+
+/*
+  Returns the Candidate for a scoped variable, or NULL if it isn't one
+*/
+static Candidate* get_candidate(StringAstNode* var){
+  char key[24];
+  if(!var) return NULL;
+  sprintf(key,"%p",(void*)(var->text));
+  return (Candidate*)get_from_map(candidates,key);
+}
+
+/*
+  Registers a local AST_DEFINE node whose value might be propagated
+  Scoped variables of defines share their name with the AST, which is what identifies them
+*/
+void register_constant_candidate(AstNode* define){
+  Candidate* c=(Candidate*)malloc(sizeof(Candidate));
+  c->key=(char*)malloc(sizeof(char)*24);
+  sprintf(c->key,"%p",(void*)(((BinaryNode*)(define->data))->text));
+  c->reads=new_default_list();
+  c->define=define;
+  c->reassigned=0;
+  c->folding=0;
+  add_to_list(candidates_list,c);
+  put_in_map(candidates,c->key,c);
+}
+
+/*
+  Records which candidate an AST_ID node reads, if any
+  Called during the check step while the variable is in scope
+*/
+void resolve_constant_read(AstNode* id){
+  Candidate* c=get_candidate(get_scoped_var((char*)(id->data)));
+  if(c){
+    add_to_list(c->reads,id);
+    id->ref=c;
+  }
+}
+
+/*
+  Stops a candidate from being propagated because an AST_ID node assigns to it
+*/
+void mark_reassigned(AstNode* id){
+  Candidate* c=get_candidate(get_scoped_var((char*)(id->data)));
+  if(c) c->reassigned=1;
+}
+
+/*
+  Parses literal text into a Constant
+  Returns 0 if the literal can't be represented exactly
+*/
+static int parse_constant(const char* text,const char* type,Constant* c){
+  char* end;
+  if(!strcmp(type,PRIMITIVE_NIL)){
+    c->kind=CONSTANT_NIL;
+    return 1;
+  }
+  if(!strcmp(type,PRIMITIVE_BOOL)){
+    c->kind=CONSTANT_BOOL;
+    c->i=!strcmp(text,"true");
+    return 1;
+  }
+  if(!strcmp(type,PRIMITIVE_STRING)){
+    int l=strlen(text);
+    if(l<2 || (text[0]!='"' && text[0]!='\'') || text[l-1]!=text[0] || strchr(text,'\\')) return 0;
+    c->kind=CONSTANT_STRING;
+    c->s=text;
+    return 1;
+  }
+  errno=0;
+  if(!strcmp(type,PRIMITIVE_INT)){
+    c->kind=CONSTANT_INT;
+    c->i=strtoll(text,&end,10);
+  }else{
+    c->kind=CONSTANT_FLOAT;
+    c->f=strtod(text,&end);
+  }
+  return !errno && !*end;
+}
+
+/*
+  Parses previously folded text back into a Constant
+*/
+static int parse_folded(const char* text,Constant* c){
+  if(text[0]=='"' || text[0]=='\'') return parse_constant(text,PRIMITIVE_STRING,c);
+  if(!strcmp(text,"nil")) return parse_constant(text,PRIMITIVE_NIL,c);
+  if(!strcmp(text,"true") || !strcmp(text,"false")) return parse_constant(text,PRIMITIVE_BOOL,c);
+  if(strpbrk(text,".e")) return parse_constant(text,PRIMITIVE_FLOAT,c);
+  return parse_constant(text,PRIMITIVE_INT,c);
+}
+
+/*
+  Writes the shortest Lua literal that reads back as the same value
+  Returns NULL if no literal represents the value exactly
+*/
+static char* stringify_constant(Constant* c){
+  char buffer[64];
+  if(c->kind==CONSTANT_NIL) sprintf(buffer,"nil");
+  if(c->kind==CONSTANT_BOOL) sprintf(buffer,c->i?"true":"false");
+  if(c->kind==CONSTANT_INT){
+    // The smallest integer can only be written as an expression
+    if(c->i==-9223372036854775807LL-1) return NULL;
+    sprintf(buffer,"%lld",c->i);
+  }
+  if(c->kind==CONSTANT_FLOAT){
+    if(isnan(c->f) || isinf(c->f)) return NULL;
+    for(int p=15;p<=17;p++){
+      sprintf(buffer,"%.*g",p,c->f);
+      if(strtod(buffer,NULL)==c->f) break;
+    }
+    if(!strpbrk(buffer,".e")) strcat(buffer,".0");
+  }
+  if(c->kind==CONSTANT_STRING) return copy_string((char*)(c->s));
+  return copy_string(buffer);
+}
+
+/*
+  Returns 1 if a Constant is truthy in Lua
+*/
+static int truthy(Constant* c){
+  return !(c->kind==CONSTANT_NIL || (c->kind==CONSTANT_BOOL && !c->i));
+}
+
+/*
+  Converts a numeric Constant into a float
+*/
+static double to_float(Constant* c){
+  return (c->kind==CONSTANT_INT)?(double)(c->i):c->f;
+}
+
+/*
+  Compares two numeric Constants exactly
+  Returns 0 if they can't be compared without losing precision, otherwise stores -1, 0 or 1 in result
+*/
+static int compare_numbers(Constant* l,Constant* r,int* result){
+  if(l->kind==CONSTANT_INT && r->kind==CONSTANT_INT){
+    *result=(l->i>r->i)-(l->i<r->i);
+    return 1;
+  }
+  long long limit=9007199254740992LL;
+  if(l->kind==CONSTANT_INT && (l->i>limit || l->i<-limit)) return 0;
+  if(r->kind==CONSTANT_INT && (r->i>limit || r->i<-limit)) return 0;
+  double a=to_float(l);
+  double b=to_float(r);
+  if(isnan(a) || isnan(b)) return 0;
+  *result=(a>b)-(a<b);
+  return 1;
+}
+
+static int fold(AstNode* node,Constant* c);
+
+/*
+  Folds a binary expression with Lua 5.3 semantics
+*/
+static int fold_binary(BinaryNode* data,Constant* c){
+  Constant l,r;
+  char* op=data->text;
+  if(!strcmp(op,"as")) return fold(data->l,c);
+  if(!fold(data->l,&l)) return 0;
+  if(!strcmp(op,"and") || !strcmp(op,"or")){
+    // Short circuiting means the right side doesn't matter when it isn't evaluated
+    if(truthy(&l)==!strcmp(op,"or")){
+      *c=l;
+      return 1;
+    }
+    return fold(data->r,c);
+  }
+  if(!fold(data->r,&r)) return 0;
+  int numbers=(l.kind==CONSTANT_INT || l.kind==CONSTANT_FLOAT) && (r.kind==CONSTANT_INT || r.kind==CONSTANT_FLOAT);
+  if(!strcmp(op,"+") || !strcmp(op,"-") || !strcmp(op,"*")){
+    if(!numbers) return 0;
+    if(l.kind==CONSTANT_INT && r.kind==CONSTANT_INT){
+      // Integer arithmetic wraps around
+      unsigned long long a=(unsigned long long)l.i;
+      unsigned long long b=(unsigned long long)r.i;
+      c->kind=CONSTANT_INT;
+      if(op[0]=='+') c->i=(long long)(a+b);
+      if(op[0]=='-') c->i=(long long)(a-b);
+      if(op[0]=='*') c->i=(long long)(a*b);
+      return 1;
+    }
+    c->kind=CONSTANT_FLOAT;
+    if(op[0]=='+') c->f=to_float(&l)+to_float(&r);
+    if(op[0]=='-') c->f=to_float(&l)-to_float(&r);
+    if(op[0]=='*') c->f=to_float(&l)*to_float(&r);
+    return 1;
+  }
+  if(!strcmp(op,"/") || !strcmp(op,"^")){
+    if(!numbers) return 0;
+    c->kind=CONSTANT_FLOAT;
+    c->f=(op[0]=='/')?to_float(&l)/to_float(&r):pow(to_float(&l),to_float(&r));
+    return 1;
+  }
+  if(!strcmp(op,"..")){
+    if(l.kind!=CONSTANT_STRING || r.kind!=CONSTANT_STRING) return 0;
+    int ll=strlen(l.s);
+    int rl=strlen(r.s);
+    if(memchr(r.s+1,l.s[0],rl-2)) return 0;
+    char* text=(char*)malloc(sizeof(char)*(ll+rl-1));
+    memcpy(text,l.s,ll-1);
+    memcpy(text+ll-1,r.s+1,rl-2);
+    text[ll+rl-3]=l.s[0];
+    text[ll+rl-2]=0;
+    add_to_list(folded,text);
+    c->kind=CONSTANT_STRING;
+    c->s=text;
+    return 1;
+  }
+  int eq=!strcmp(op,"==");
+  if(eq || !strcmp(op,"~=")){
+    int same;
+    if(numbers){
+      int cmp;
+      if(!compare_numbers(&l,&r,&cmp)) return 0;
+      same=!cmp;
+    }else if(l.kind!=r.kind){
+      same=0;
+    }else if(l.kind==CONSTANT_STRING){
+      same=!strncmp(l.s+1,r.s+1,strlen(l.s)-2) && strlen(l.s)==strlen(r.s);
+    }else{
+      same=(l.kind==CONSTANT_NIL) || l.i==r.i;
+    }
+    c->kind=CONSTANT_BOOL;
+    c->i=(same==eq);
+    return 1;
+  }
+  if(!numbers) return 0;
+  int cmp;
+  if(!compare_numbers(&l,&r,&cmp)) return 0;
+  c->kind=CONSTANT_BOOL;
+  if(!strcmp(op,"<")) c->i=cmp<0;
+  else if(!strcmp(op,"<=")) c->i=cmp<=0;
+  else if(!strcmp(op,">")) c->i=cmp>0;
+  else if(!strcmp(op,">=")) c->i=cmp>=0;
+  else return 0;
+  return 1;
+}
+
+/*
+  Folds a unary expression with Lua 5.3 semantics
+*/
+static int fold_unary(BinaryNode* data,Constant* c){
+  if(!fold(data->l,c)) return 0;
+  if(!strcmp(data->text,"trust")) return 1;
+  if(!strcmp(data->text,"not")){
+    c->i=!truthy(c);
+    c->kind=CONSTANT_BOOL;
+    return 1;
+  }
+  if(!strcmp(data->text,"#")){
+    if(c->kind!=CONSTANT_STRING) return 0;
+    c->i=strlen(c->s)-2;
+    c->kind=CONSTANT_INT;
+    return 1;
+  }
+  if(!strcmp(data->text,"-")){
+    if(c->kind==CONSTANT_INT){
+      c->i=(long long)(0ULL-(unsigned long long)(c->i));
+      return 1;
+    }
+    if(c->kind==CONSTANT_FLOAT){
+      c->f=-c->f;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Computes the constant value of an expression
+  Returns 0 if the expression isn't constant
+*/
+static int fold(AstNode* node,Constant* c){
+  if(node->type==AST_PRIMITIVE){
+    StringAstNode* data=(StringAstNode*)(node->data);
+    return parse_constant(data->text,(char*)(data->node->data),c);
+  }
+  if(node->type==AST_ID){
+    Candidate* candidate=(Candidate*)(node->ref);
+    if(!candidate || node->resolution!=RS_NONE || candidate->reassigned || candidate->folding) return 0;
+    AstNode* value=((BinaryNode*)(candidate->define->data))->r;
+    candidate->folding=1;
+    int res=value && fold(value,c);
+    candidate->folding=0;
+    return res;
+  }
+  if(node->type!=AST_PAREN && node->type!=AST_UNARY && node->type!=AST_BINARY) return 0;
+  if(node->resolution==RS_FOLDED) return parse_folded((char*)(node->ref),c);
+  if(node->resolution==RS_VARIABLE) return 0;
+  int res=0;
+  if(node->type==AST_PAREN) res=fold((AstNode*)(node->data),c);
+  if(node->type==AST_UNARY) res=fold_unary((BinaryNode*)(node->data),c);
+  if(node->type==AST_BINARY) res=fold_binary((BinaryNode*)(node->data),c);
+  char* text=res?stringify_constant(c):NULL;
+  if(text){
+    add_to_list(folded,text);
+    node->resolution=RS_FOLDED;
+    node->ref=text;
+    return parse_folded(text,c);
+  }
+  node->resolution=RS_VARIABLE;
+  return 0;
+}
+
+/*
+  Returns the Lua literal an expression folds into, or NULL if it isn't constant
+  Only folds expressions that Lua would otherwise evaluate at runtime
+*/
+char* fold_constant(AstNode* node){
+  Constant c;
+  if(node->type!=AST_ID && node->type!=AST_PAREN && node->type!=AST_UNARY && node->type!=AST_BINARY) return NULL;
+  if(!fold(node,&c)) return NULL;
+  if(node->type!=AST_ID) return (char*)(node->ref);
+  AstNode* value=((BinaryNode*)(((Candidate*)(node->ref))->define->data))->r;
+  if(value->type==AST_PRIMITIVE) return ((StringAstNode*)(value->data))->text;
+  return fold_constant(value);
+}
+
+/*
+  Returns 1 if every read of a local AST_DEFINE node is replaced by its constant value
+  Only meaningful during the output step, once every read has been resolved
+*/
+int unread_local(AstNode* define){
+  char key[24];
+  sprintf(key,"%p",(void*)(((BinaryNode*)(define->data))->text));
+  Candidate* c=(Candidate*)get_from_map(candidates,key);
+  if(!c) return 0;
+  for(int a=0;a<c->reads->n;a++){
+    AstNode* id=(AstNode*)get_from_list(c->reads,a);
+    if(id->ref!=c || !fold_constant(id)) return 0;
+  }
+  return 1;
+}
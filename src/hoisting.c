@@ -0,0 +1,168 @@
+#include "./internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+static const char* library_functions[]={
+  "assert", "error", "getmetatable", "ipairs", "next", "pairs", "pcall", "print", "rawequal",
+  "rawget", "rawlen", "rawset", "select", "setmetatable", "tonumber", "tostring", "type", "xpcall",
+  NULL
+};
+static const char* library_tables[]={
+  "coroutine", "debug", "io", "math", "os", "string", "table", "utf8",
+  NULL
+};
+static Map* globals; // Globals keyed by name
+static List* globals_list; // Every Global in the order it was first seen
+static int escaped; // 1 if the chunk reads the global environment itself, so it might change any global
+static Map* names; // Names the chunk uses for its own values, which aliases of fields must not take
+
+/*
+  Initializes this module
+*/
+void init_hoisting(){
+  globals=new_default_map();
+  globals_list=new_default_list();
+  names=new_default_map();
+  escaped=0;
+}
+
+/*
+  Deallocates data used by this module
+*/
+void dealloc_hoisting(){
+  for(int a=0;a<globals_list->n;a++){
+    Global* g=(Global*)get_from_list(globals_list,a);
+    free(g->alias);
+    free(g->name);
+    free(g);
+  }
+  dealloc_list(globals_list);
+  dealloc_map(globals);
+  for(int a=0;a<names->n;a++) free(names->data[a].k);
+  dealloc_map(names);
+}
+
+/*
+  Returns 1 if a name is in a NULL-terminated list of names
+*/
+static int named_in(const char** names,char* name){
+  for(int a=0;names[a];a++) if(!strcmp(names[a],name)) return 1;
+  return 0;
+}
+
+/*
+  Returns the Global for a name, creating it if it hasn't been seen yet
+*/
+static Global* get_global(char* name,char* alias,Global* table){
+  Global* g=(Global*)get_from_map(globals,name);
+  if(g){
+    free(alias);
+    free(name);
+    return g;
+  }
+  g=(Global*)malloc(sizeof(Global));
+  g->table=table;
+  g->alias=alias;
+  g->name=name;
+  g->hoisted=0;
+  g->assigned=0;
+  g->reads=0;
+  add_to_list(globals_list,g);
+  put_in_map(globals,g->name,g);
+  return g;
+}
+
+/*
+  Records a read of a global variable during the check step
+  Returns its Global if the read could go through an alias, otherwise NULL
+  Aliases of globals share their name, so they are shadowed exactly like the globals were
+*/
+Global* read_global(char* name){
+  if(!strcmp(name,"_G") || !strcmp(name,"_ENV")) escaped=1;
+  if(!named_in(library_functions,name) && !named_in(library_tables,name)) return NULL;
+  Global* g=get_global(copy_string(name),copy_string(name),NULL);
+  g->reads++;
+  return g;
+}
+
+/*
+  Records a read of a field of a global during the check step
+  Returns the field's Global if the global is a library table, otherwise NULL
+  An aliased field is read without reading its table, so the read moves from the table to the field
+*/
+Global* read_global_field(Global* table,char* field){
+  if(!named_in(library_tables,table->name)) return NULL;
+  char* name=(char*)malloc(sizeof(char)*(strlen(table->name)+strlen(field)+2));
+  char* alias=(char*)malloc(sizeof(char)*(strlen(table->name)+strlen(field)+3));
+  sprintf(name,"%s.%s",table->name,field);
+  sprintf(alias,"%s__%s",table->name,field);
+  Global* g=get_global(name,alias,table);
+  table->reads--;
+  g->reads++;
+  return g;
+}
+
+/*
+  Records a name that the chunk reads, assigns or declares during the check step
+*/
+void reserve_name(char* name){
+  if(get_from_map(names,name)) return;
+  char* copy=copy_string(name);
+  put_in_map(names,copy,copy);
+}
+
+/*
+  Stops a global from being hoisted because the chunk assigns to it or declares a variable with its name
+*/
+void mark_global_assigned(char* name){
+  reserve_name(name);
+  if(!named_in(library_functions,name) && !named_in(library_tables,name)) return;
+  get_global(copy_string(name),copy_string(name),NULL)->assigned=1;
+}
+
+/*
+  Returns 1 if the chunk uses a field's alias itself or another global already has it
+*/
+static int alias_taken(Global* g){
+  if(get_from_map(names,g->alias)) return 1;
+  for(int a=0;a<globals_list->n;a++){
+    Global* other=(Global*)get_from_list(globals_list,a);
+    if(other!=g && !strcmp(other->alias,g->alias)) return 1;
+  }
+  return 0;
+}
+
+/*
+  Lengthens the alias of a field until no name in the chunk collides with it
+*/
+static void fresh_alias(Global* g){
+  while(alias_taken(g)){
+    g->alias=(char*)realloc(g->alias,sizeof(char)*(strlen(g->alias)+2));
+    strcat(g->alias,"_");
+  }
+}
+
+/*
+  Decides which globals are hoisted once the check step has seen the whole chunk
+  At most max aliases are declared, since they count against the main function's locals
+  Returns every Global in the order its alias should be declared
+*/
+List* hoist_globals(int max){
+  int n=0;
+  for(int a=0;a<globals_list->n;a++){
+    Global* g=(Global*)get_from_list(globals_list,a);
+    if(!g->table) continue;
+    g->hoisted=!escaped && g->reads && !g->assigned && !g->table->assigned;
+
+    // Fields that aren't aliased are read through their table again
+    if(!g->hoisted) g->table->reads+=g->reads;
+  }
+  for(int a=0;a<globals_list->n;a++){
+    Global* g=(Global*)get_from_list(globals_list,a);
+    if(!g->table) g->hoisted=!escaped && g->reads>0 && !g->assigned;
+    if(g->hoisted && ++n>max) g->hoisted=0;
+    if(g->hoisted && g->table) fresh_alias(g);
+  }
+  return globals_list;
+}
@@ -32,9 +32,12 @@ typedef struct{
 } Pair;
 typedef struct{
   Pair* data;
+  int* slots; // Hash index into data (0 is an empty slot, otherwise the pair's index plus 1)
+  int num_slots;
   int max;
   int n;
 } Map;
+unsigned int hash_string(const char* k);
 Map* new_map(int max);
 Map* new_default_map();
 void* get_from_map(Map* m,char* k);
@@ -42,6 +45,22 @@ void* iterate_from_map(Map* m,int i);
 void put_in_map(Map* m,char* k,void* v);
 void dealloc_map(Map* m);
 
+/*
+  Buffer: a growable string of bytes
+*/
+typedef struct{
+  char* data;
+  int max;
+  int n;
+} Buffer;
+Buffer* new_buffer(int max);
+Buffer* new_default_buffer();
+void append_to_buffer(Buffer* b,const char* str,int l);
+void append_string_to_buffer(Buffer* b,const char* str);
+void flush_buffer(Buffer* b,FILE* f);
+char* collapse_buffer(Buffer* b);
+void dealloc_buffer(Buffer* b);
+
 /*
   Token: a symbol from the input code utilized by the parser
 */
@@ -49,15 +68,22 @@ typedef struct{
   char* text;
   int type;
   int line;
+  int column;
 } Token;
 
 void deallocate_token(Token* token);
 
 // AST node types
-typedef struct{
+typedef struct AstNode{
+  struct AstNode* cached_type; // Memoized result of get_type
+  int type_epoch; // Types epoch that cached_type was computed in
+  int resolution; // How the check step resolved this node (check enum Resolutions)
+  int visibility; // Whether a top-level definition is visible outside the chunk (check enum Visibilities)
+  void* ref; // Declaration the check step resolved this node to, or NULL
   void* data;
   int type;
   int line;
+  int column; // Column of the token the node starts at, or -1 for nodes made by the compiler
 } AstNode;
 
 typedef struct{
@@ -67,6 +93,9 @@ typedef struct{
 
 typedef struct{
   int is_constructor; // 1 if the function is a constructor
+  int is_final; // 1 if the function is a method that subclasses can't override
+  int reassigned; // 1 if the chunk assigns something else to the function's name
+  int is_typed; // 1 if the function was declared with a return type rather than the function keyword
   AstNode* functype; // Overall function type
   AstNode* name; // An AST_LHS or AST_ID node representing the name, or NULL for constructors
   AstNode* type; // Return type of the function (part of functype)
@@ -112,18 +141,35 @@ typedef struct{
 typedef struct{
   AstNode* type; // Type representing the interface itself
   char* parent; // Name of parent interface, or NULL if there is none
+  Map* members; // Map of member names to MemberNodes, or NULL if not built yet
   char* name; // Name of interface
   List* ls; // List of AstNodes (AST_FUNCTION nodes)
 } InterfaceNode;
 
+typedef struct{
+  FunctionNode* constructor; // The class's own constructor, or NULL if there is none
+  List* missing; // List of interface FunctionNodes the class does not implement
+  Map* fields; // Flattened ancestor fields and methods, or NULL if names collide
+} ClassLayout;
+
 typedef struct{
   List* interfaces; // List of strings
   AstNode* type; // Type representing the class itself
+  ClassLayout* layout; // Cached layout of the class, or NULL if not built yet
   char* parent; // Name of parent class, or NULL if there is none
+  Map* members; // Map of member names to MemberNodes, or NULL if not built yet
   char* name; // Name of class
+  int is_final; // 1 if the class can't be extended
   List* ls; // List of AstNodes
 } ClassNode;
 
+typedef struct{
+  void* entity; // ClassNode or InterfaceNode that declares the member
+  AstNode* node; // Declaring AST_FUNCTION or AST_DEFINE node
+  AstNode* type; // Type of the member
+  int kind; // AST_FUNCTION or AST_DEFINE
+} MemberNode;
+
 typedef struct{
   AstNode* expr;
   AstNode* next;
@@ -138,12 +184,25 @@ typedef struct{
   int scope; // The index of the scope where this equivalence was defined
 } EqualTypesNode;
 
+typedef struct HierarchyNode{
+  struct HierarchyNode* parent; // Node this type extends, or NULL if it is a root
+  List* implementations; // List of HierarchyNodes for the types this type implements
+  List* children; // List of HierarchyNodes that extend this type
+  unsigned char* implemented; // Bitset of node IDs this type is a subtype of through implements edges
+  char* name; // Name of the entity type
+  int pure; // 1 if the name has no RL_EQUALS edges (it names an entity and not a typedef)
+  int pre; // Pre-order number in the extends forest
+  int post; // Post-order number in the extends forest
+  int id; // Index of this node's bit in implemented bitsets
+} HierarchyNode;
+
 typedef struct{
   List* interfaces_registry; // List of InterfaceNodes
   List* functions_registry; // List of FunctionNodes
   List* classes_registry; // List of ClassNodes
   List* types_registry; // List of strings
   List* defs; // List of StringAstNodes representing local definitions
+  List* decls; // List of declaration AstNodes collected by the typedef step
   void* data; // Context node attached to this scope
   int type; // The type of this scope
 } Scope;
@@ -174,6 +233,23 @@ enum RELATIONS{
   RL_EXTENDS, RL_EQUALS, RL_IMPLEMENTS
 };
 
+// Enum for name resolutions recorded by the check step for output
+enum RESOLUTIONS{
+  RS_NONE, RS_INSTANCE, RS_FIELD, RS_LOCAL, RS_METHOD, RS_CONSTANT, RS_FOLDED, RS_VARIABLE, RS_GLOBAL, RS_DIRECT, RS_FUNCTION, RS_ASSIGNED
+};
+
+// Enum for the visibility of top-level definitions
+enum VISIBILITIES{
+  VS_GLOBAL, // Definitions in files that don't export anything stay global
+  VS_EXPORTED, // Definitions marked with export
+  VS_HIDDEN // Every other top-level definition in a file that exports something
+};
+
+// Enum for the kinds of code left out of the output by dead code elimination
+enum ELIMINATIONS{
+  EL_STATEMENT, EL_BRANCH, EL_LOCAL, NUM_ELIMINATIONS
+};
+
 // Enum for all possible tokens
 enum TOKENS{
 
@@ -248,19 +324,67 @@ enum RULES{
   AST_FORIN, AST_ELSEIF, AST_IF,
 
   // Node's data is something else
-  AST_UNKNOWN
+  AST_UNKNOWN,
+
+  // Number of grammar rules
+  NUM_RULES
 };
 
+/*
+  Diagnostic: a compilation error whose message is rendered on demand
+*/
+typedef struct{
+  const char* msg; // Message template, which also identifies the kind of error
+  char* message; // Rendered message without its location, NULL until it is requested
+  char* text; // Rendered message, NULL until it is requested
+  int line; // Line the error was reported on, or -1
+  int column; // Column the error was reported at, or -1
+  int file; // Index of the file the error was reported in, or -1
+  int args; // Offset of the error's typed arguments in the arguments arena
+} Diagnostic;
+
+/*
+  Global: a standard library value that the output can read through a local alias
+*/
+typedef struct Global{
+  struct Global* table; // Library table this value is a field of, or NULL
+  char* alias; // Name of the local that holds the value
+  char* name; // Lua expression for the value, like print or string.format
+  int assigned; // 1 if the chunk might assign to the global or shadow its name
+  int hoisted; // 1 if the output declares the alias
+  int reads; // Number of reads that would go through the alias
+} Global;
+
 // Implemented in moonshot.c
-void add_error_internal(int line,const char* msg,va_list args);
-char* format_string(int indent,const char* msg,va_list args);
-void add_error(int line,const char* msg,...);
+void format_to_buffer(Buffer* b,int indent,const char* msg,va_list args);
+void add_error_internal(int line,int column,const char* msg,va_list args);
+void add_error(int line,int column,const char* msg,...);
 int require_file(char* filename,int step);
 char* collapse_string_list(List* ls);
 void dealloc_token_buffer(List* ls);
 char* strip_quotes(char* str);
 char* copy_string(char* str);
-char* string_from_int(int a);
+int moonshot_error_limit_reached();
+int moonshot_option(int option);
+int moonshot_num_errors();
+
+// Implemented in folding.c
+void register_constant_candidate(AstNode* define);
+void resolve_constant_read(AstNode* id);
+char* fold_constant(AstNode* node);
+void mark_reassigned(AstNode* id);
+int unread_local(AstNode* define);
+void dealloc_folding();
+void init_folding();
+
+// Implemented in hoisting.c
+Global* read_global_field(Global* table,char* field);
+void mark_global_assigned(char* name);
+void reserve_name(char* name);
+Global* read_global(char* name);
+List* hoist_globals(int max);
+void dealloc_hoisting();
+void init_hoisting();
 
 // Implemented in tokenizer.c
 void dealloc_token(Token* tk);
@@ -278,6 +402,7 @@ AstNode* parse_call(AstNode* lhs);
 AstNode* parse_table_or_list();
 AstNode* parse_set_or_call();
 AstNode* parse_interface();
+AstNode* parse_export();
 AstNode* parse_typedef();
 AstNode* parse_require();
 AstNode* parse_repeat();
@@ -321,9 +446,15 @@ AstListNode* new_ast_list_node(AstNode* ast,List* list);
 AstAstNode* new_ast_ast_node(AstNode* l,AstNode* r);
 TableNode* new_table_node(List* keys,List* vals);
 BinaryNode* new_unary_node(char* op,AstNode* e);
-AstNode* new_node(int type,int line,void* data);
-void dealloc_ast_type(AstNode* node);
+AstNode* new_function_type(AstNode* ret,List* args);
+AstNode* new_node(int type,int line,int column,void* data);
+AstNode* new_basic_type(const char* name);
+AstNode* new_tuple_type(List* ls);
 void dealloc_ast_node(AstNode* node);
+AstNode* new_vararg_type();
+void dealloc_types_table();
+AstNode* new_any_type();
+void init_types_table();
 
 /*
 *   The parsing step should not have
@@ -362,15 +493,21 @@ void pop_scope();
 int add_type_equivalence(char* name,AstNode* type,int relation);
 int add_child_type(char* child,char* parent,int relation);
 void quell_expired_scope_equivalences(int scope);
+void index_type_hierarchy();
 int is_primitive(AstNode* node,const char* type);
+void invalidate_cached_types();
+AstNode* get_function_type(FunctionNode* data);
 int types_equivalent(char* name,AstNode* type);
 int compound_type_exists(AstNode* node);
 List* get_equivalent_types(char* name);
 int typed_match(AstNode* l,AstNode* r);
 int is_variadic_function(List* args);
+void stringify_type_to_buffer(Buffer* b,AstNode* node);
 char* stringify_type(AstNode* node);
 AstNode* get_type(AstNode* node);
 char* base_type(char* name);
+int num_typed_match_misses();
+int num_typed_match_hits();
 void print_types_graph();
 void dealloc_types();
 void init_types();
@@ -379,14 +516,20 @@ void init_types();
 FunctionNode* get_parent_method(ClassNode* clas,FunctionNode* method);
 int methods_equivalent(FunctionNode* f1,FunctionNode* f2);
 List* get_missing_class_methods(ClassNode* node);
+Map* get_interface_members(InterfaceNode* node);
 FunctionNode* get_constructor(ClassNode* data);
+void dealloc_class_layout(ClassLayout* layout);
+ClassLayout* get_class_layout(ClassNode* node);
 Map* collapse_ancestor_class_fields(List* ls);
-List* get_all_expected_fields(AstNode* node);
 List* get_all_class_fields(ClassNode* data);
+Map* get_class_members(ClassNode* node);
 int num_constructors(ClassNode* data);
+void index_entity_members(List* ls);
+void dealloc_members(Map* members);
 
 // Implemented in traversal.c
 void traverse(AstNode* node,int step);
+int num_eliminated(int kind);
 void dealloc_traverse();
 void init_traverse();
 int get_num_indents();
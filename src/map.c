@@ -3,12 +3,53 @@
 #include <string.h>
 #include <assert.h>
 
+/*
+  Hashes a key string (FNV-1a)
+*/
+unsigned int hash_string(const char* k){
+  unsigned int h=2166136261u;
+  while(*k){
+    h^=(unsigned char)(*k++);
+    h*=16777619u;
+  }
+  return h;
+}
+
+/*
+  Returns the slot in the map's hash index where key k lives
+  Returns the empty slot where k should be placed if k is not in the map
+*/
+static int find_slot(Map* m,char* k){
+  int mask=m->num_slots-1;
+  int s=hash_string(k)&mask;
+  while(m->slots[s]){
+    if(!strcmp(m->data[m->slots[s]-1].k,k)) return s;
+    s=(s+1)&mask;
+  }
+  return s;
+}
+
+/*
+  Rebuilds the map's hash index with some number of slots
+  num_slots must be a power of 2 larger than the number of pairs
+*/
+static void rebuild_slots(Map* m,int num_slots){
+  free(m->slots);
+  m->slots=(int*)calloc(num_slots,sizeof(int));
+  m->num_slots=num_slots;
+  for(int a=0;a<m->n;a++) m->slots[find_slot(m,m->data[a].k)]=a+1;
+}
+
 /*
   Instantiates a new Map object with some initial max capacity
 */
 Map* new_map(int max){
   Pair* items=(Pair*)malloc(max*sizeof(Pair));
   Map* m=(Map*)malloc(sizeof(Map));
+  int num_slots=1;
+  while(num_slots<max*2) num_slots*=2;
+  m->slots=(int*)calloc(num_slots,sizeof(int));
+  m->num_slots=num_slots;
   m->data=items;
   m->max=max;
   m->n=0;
@@ -26,11 +67,8 @@ Map* new_default_map(){
   Returns a value associated with some key from a map
 */
 void* get_from_map(Map* m,char* k){
-  for(int a=0;a<m->n;a++){
-    Pair p=m->data[a];
-    if(!strcmp(p.k,k)) return p.v;
-  }
-  return NULL;
+  int s=m->slots[find_slot(m,k)];
+  return s?(m->data[s-1].v):NULL;
 }
 
 /*
@@ -46,14 +84,13 @@ void* iterate_from_map(Map* m,int i){
   Puts a key-value pair in a map
   Doubles the max length of the map if it's already full
   Replaces the value associates with key k if it already exists
+  Pairs keep their insertion order for iterate_from_map
 */
 void put_in_map(Map* m,char* k,void* v){
-  for(int a=0;a<m->n;a++){
-    Pair p=m->data[a];
-    if(!strcmp(p.k,k)){
-      (m->data[a]).v=v;
-      return;
-    }
+  int s=find_slot(m,k);
+  if(m->slots[s]){
+    (m->data[m->slots[s]-1]).v=v;
+    return;
   }
   if(m->n==m->max){
     m->max*=2;
@@ -65,6 +102,8 @@ void put_in_map(Map* m,char* k,void* v){
   m->data[m->n].k=k;
   m->data[m->n].v=v;
   m->n++;
+  if(m->n*2>m->num_slots) rebuild_slots(m,m->num_slots*2);
+  else m->slots[s]=m->n;
 }
 
 /*
@@ -72,6 +111,7 @@ void put_in_map(Map* m,char* k,void* v){
   Does not touch the map's contents
 */
 void dealloc_map(Map* m){
+  free(m->slots);
   free(m->data);
   free(m);
 }
@@ -7,9 +7,18 @@
 #include <assert.h>
 #define ERROR_BUFFER_LENGTH 256 // Maximum length for an error message
 static int line_written; // Zero if there's no content on the current output line yet
+static char* tabs; // Cached indentation string of max_tabs tabs
+static int max_tabs; // Length of the cached indentation string
 static List* srcs; // Stack of files you're parsing/traversing
 static List* requires; // List of required files
-static List* errors; // List of error strings
+static Diagnostic* errors; // Structured compilation errors, rendered to text when consumed
+static MoonshotDiagnostic* reports; // Errors as returned by moonshot_diagnostics
+static int options[NUM_OPTIONS]; // Values of the options set with moonshot_set_option
+static int error_limit; // Number of errors that stops compilation early (0 for no limit)
+static List* error_files; // Names of the files that errors were reported in
+static Buffer* error_args; // Arena of the typed arguments for every error
+static int max_errors; // Number of errors that fit in the errors array
+static int num_errors; // Number of errors reported
 static int error_i; // Index of currently consumed error
 static FILE* _input; // Input for source code
 
@@ -17,7 +26,87 @@ static FILE* _input; // Input for source code
   Return the number of compilation errors
 */
 int moonshot_num_errors(){
-  return errors->n;
+  return num_errors;
+}
+
+/*
+  Sets one of the options in enum MOONSHOT_OPTIONS
+*/
+void moonshot_set_option(int option,int value){
+  assert(option>=0 && option<NUM_OPTIONS);
+  options[option]=value;
+}
+
+/*
+  Returns the value of one of the options in enum MOONSHOT_OPTIONS
+*/
+int moonshot_option(int option){
+  return options[option];
+}
+
+/*
+  Sets the number of errors after which compilation stops early
+  A limit of 0 reports every error
+*/
+void moonshot_set_max_errors(int max){
+  error_limit=max;
+}
+
+/*
+  Returns 1 if enough errors were reported to stop compilation
+*/
+int moonshot_error_limit_reached(){
+  return error_limit && num_errors>=error_limit;
+}
+
+/*
+  Renders an error's message from its template and typed arguments
+*/
+static void render_error_message(Diagnostic* e){
+  Buffer* b=new_default_buffer();
+  const char* arg=error_args->data+e->args;
+  const char* start=e->msg;
+  const char* c=e->msg;
+  while(*c){
+    if(*c=='%' && (c[1]=='s' || c[1]=='t' || c[1]=='i')){
+      append_to_buffer(b,start,c-start);
+      if(c[1]=='i'){
+        int v;
+        char str[12];
+        memcpy(&v,arg,sizeof(int));
+        append_to_buffer(b,str,sprintf(str,"%i",v));
+        arg+=sizeof(int);
+      }else{
+        int l=strlen(arg);
+        append_to_buffer(b,arg,l);
+        arg+=l+1;
+      }
+      c+=2;
+      start=c;
+      continue;
+    }
+    c++;
+  }
+  append_to_buffer(b,start,c-start);
+  e->message=collapse_buffer(b);
+}
+
+/*
+  Renders an error's message followed by where the error was found
+*/
+static void render_error(Diagnostic* e){
+  if(!e->message) render_error_message(e);
+  Buffer* b=new_default_buffer();
+  append_string_to_buffer(b,e->message);
+  if(e->file>=0){
+    append_string_to_buffer(b," in ");
+    append_string_to_buffer(b,(char*)get_from_list(error_files,e->file));
+  }
+  if(e->line>=0){
+    char suffix[24];
+    append_to_buffer(b,suffix,sprintf(suffix," (line %i)",e->line));
+  }
+  e->text=collapse_buffer(b);
 }
 
 /*
@@ -25,59 +114,94 @@ int moonshot_num_errors(){
   Returns NULL if there's no more errors
 */
 char* moonshot_next_error(){
-  if(errors && error_i<errors->n) return (char*)get_from_list(errors,error_i++);
+  if(errors && error_i<num_errors){
+    Diagnostic* e=&errors[error_i++];
+    if(!e->text) render_error(e);
+    return e->text;
+  }
   return NULL;
 }
 
 /*
-  Custom string format function
+  Returns every error from compilation as an array of n MoonshotDiagnostics
+  The array is valid until the next compilation or moonshot_destroy
+*/
+MoonshotDiagnostic* moonshot_diagnostics(int* n){
+  *n=num_errors;
+  if(!num_errors) return NULL;
+  if(!reports){
+    reports=(MoonshotDiagnostic*)malloc(sizeof(MoonshotDiagnostic)*num_errors);
+    for(int a=0;a<num_errors;a++){
+      Diagnostic* e=&errors[a];
+      if(!e->message) render_error_message(e);
+      reports[a].file=(e->file>=0)?(char*)get_from_list(error_files,e->file):NULL;
+      reports[a].id=hash_string(e->msg);
+      reports[a].message=e->message;
+      reports[a].severity="error";
+      reports[a].line=e->line;
+      reports[a].column=e->column;
+    }
+  }
+  return reports;
+}
+
+/*
+  Returns how much dead code the last compilation left out of its output and how often types were compared
 */
-char* format_string(int indent,const char* msg,va_list args){
-  List* ls=new_default_list();
-  char symbol[2]={0,0};
-  int n=strlen(msg);
-  for(int a=0;a<n;a++){
+MoonshotStats moonshot_stats(){
+  MoonshotStats stats;
+  stats.unreachable_statements=num_eliminated(EL_STATEMENT);
+  stats.constant_branches=num_eliminated(EL_BRANCH);
+  stats.unused_locals=num_eliminated(EL_LOCAL);
+  stats.type_match_hits=num_typed_match_hits();
+  stats.type_match_misses=num_typed_match_misses();
+  return stats;
+}
+
+/*
+  Custom string format function, appends the formatted message to a Buffer
+  Supports %s for strings, %i for ints and %t for types
+  Indents the start of each output line if indent is nonzero
+*/
+void format_to_buffer(Buffer* b,int indent,const char* msg,va_list args){
+  const char* start=msg;
+  const char* c=msg;
+  while(*c){
     if(indent){
-      if(msg[a]=='\n'){
+      if(*c=='\n'){
         line_written=0;
       }else if(!line_written){
+        append_to_buffer(b,start,c-start);
+        start=c;
         line_written=1;
-        for(int a=0;a<get_num_indents();a++){
-          char* tab=(char*)malloc(sizeof(char)*3);
-          sprintf(tab,"\t");
-          add_to_list(ls,tab);
+        int n=get_num_indents();
+        if(n>max_tabs){
+          while(max_tabs<n) max_tabs=max_tabs?max_tabs*2:8;
+          tabs=(char*)realloc(tabs,sizeof(char)*max_tabs);
+          memset(tabs,'\t',max_tabs);
         }
+        append_to_buffer(b,tabs,n);
       }
     }
-    if(a<n-1 && msg[a]=='%'){
-      if(msg[a+1]=='s'){
-        char* str=va_arg(args,char*);
-        add_to_list(ls,copy_string(str));
-        a++;
-        continue;
-      }
-      if(msg[a+1]=='t'){
-        AstNode* type=(AstNode*)va_arg(args,AstNode*);
-        char* str=stringify_type(type);
-        add_to_list(ls,str);
-        a++;
-        continue;
-      }
-      if(msg[a+1]=='i'){
-        int v=va_arg(args,int);
-        char* str=string_from_int(v);
-        add_to_list(ls,str);
-        a++;
-        continue;
+    if(*c=='%' && (c[1]=='s' || c[1]=='t' || c[1]=='i')){
+      append_to_buffer(b,start,c-start);
+      if(c[1]=='s'){
+        append_string_to_buffer(b,va_arg(args,char*));
+      }else if(c[1]=='t'){
+        char* str=stringify_type((AstNode*)va_arg(args,AstNode*));
+        append_string_to_buffer(b,str);
+        free(str);
+      }else{
+        char str[12];
+        append_to_buffer(b,str,sprintf(str,"%i",va_arg(args,int)));
       }
+      c+=2;
+      start=c;
+      continue;
     }
-    symbol[0]=msg[a];
-    add_to_list(ls,copy_string(symbol));
+    c++;
   }
-  char* str=collapse_string_list(ls);
-  for(int a=0;a<ls->n;a++) free(get_from_list(ls,a));
-  free(ls);
-  return str;
+  append_to_buffer(b,start,c-start);
 }
 
 /*
@@ -85,31 +209,52 @@ char* format_string(int indent,const char* msg,va_list args){
   Must include at least one parameter after msg or you'll get an error
   Exits with a special error if your msg and va_args cause the error buffer to overflow
 */
-void add_error(int line,const char* msg,...){
+void add_error(int line,int column,const char* msg,...){
   va_list args;
   va_start(args,msg);
-  add_error_internal(line,msg,args);
+  add_error_internal(line,column,msg,args);
   va_end(args);
 }
-void add_error_internal(int line,const char* msg,va_list args){
-  List* ls=new_default_list();
-  add_to_list(ls,format_string(0,msg,args));
-  if(srcs->n){
+void add_error_internal(int line,int column,const char* msg,va_list args){
+  if(moonshot_error_limit_reached()) return;
+  if(num_errors==max_errors){
+    max_errors*=2;
+    errors=(Diagnostic*)realloc(errors,sizeof(Diagnostic)*max_errors);
+  }
+  Diagnostic* e=&errors[num_errors++];
+  e->args=error_args->n;
+  e->message=NULL;
+  e->text=NULL;
+  e->line=line;
+  e->column=column;
+  e->msg=msg;
+  e->file=-1;
+  if(srcs && srcs->n){
     char* file=(char*)get_from_list(srcs,srcs->n-1);
-    char* suffix=(char*)malloc(sizeof(char)*(strlen(file)+5));
-    sprintf(suffix," in %s",file);
-    add_to_list(ls,suffix);
+    int n=error_files->n;
+    if(n && !strcmp((char*)get_from_list(error_files,n-1),file)){
+      e->file=n-1;
+    }else{
+      add_to_list(error_files,copy_string(file));
+      e->file=n;
+    }
   }
-  if(line>=0){
-    char* str=string_from_int(line);
-    char* suffix=(char*)malloc(sizeof(char)*(strlen(str)+9));
-    sprintf(suffix," (line %i)",line);
-    add_to_list(ls,suffix);
+  for(const char* c=msg;*c;c++){
+    if(*c!='%') continue;
+    if(c[1]=='s'){
+      char* str=va_arg(args,char*);
+      append_to_buffer(error_args,str,strlen(str)+1);
+      c++;
+    }else if(c[1]=='t'){
+      stringify_type_to_buffer(error_args,(AstNode*)va_arg(args,AstNode*));
+      append_to_buffer(error_args,"",1);
+      c++;
+    }else if(c[1]=='i'){
+      int v=va_arg(args,int);
+      append_to_buffer(error_args,(char*)&v,sizeof(int));
+      c++;
+    }
   }
-  char* err=collapse_string_list(ls);
-  for(int a=0;a<ls->n;a++) free(get_from_list(ls,a));
-  free(ls);
-  add_to_list(errors,err);
 }
 
 /*
@@ -121,24 +266,42 @@ void dealloc_token_buffer(List* ls){
 }
 
 /*
-  Deallocates all error strings in the errors list and the list itself
+  Initializes an empty error stream
+*/
+static void init_errors(){
+  errors=(Diagnostic*)malloc(sizeof(Diagnostic)*16);
+  error_args=new_default_buffer();
+  error_files=new_default_list();
+  max_errors=16;
+  num_errors=0;
+  error_i=0;
+}
+
+/*
+  Deallocates all errors, their rendered messages and their arguments
 */
 static void dealloc_errors(){
-  for(int a=0;a<errors->n;a++) free(get_from_list(errors,a));
-  dealloc_list(errors);
+  for(int a=0;a<num_errors;a++){
+    free(errors[a].message);
+    free(errors[a].text);
+  }
+  for(int a=0;a<error_files->n;a++) free(get_from_list(error_files,a));
+  dealloc_list(error_files);
+  dealloc_buffer(error_args);
+  free(reports);
+  free(errors);
+  reports=NULL;
   errors=NULL;
+  num_errors=0;
 }
 
 /*
   Takes a List of strings and collapses it into one single string
 */
 char* collapse_string_list(List* ls){
-  int l=0;
-  for(int a=0;a<ls->n;a++) l+=strlen((char*)get_from_list(ls,a));
-  char* copy=(char*)malloc(sizeof(char)*(l+1));
-  copy[0]=0;
-  for(int a=0;a<ls->n;a++) strcat(copy,(char*)get_from_list(ls,a));
-  return copy;
+  Buffer* b=new_default_buffer();
+  for(int a=0;a<ls->n;a++) append_string_to_buffer(b,(char*)get_from_list(ls,a));
+  return collapse_buffer(b);
 }
 
 /*
@@ -162,17 +325,6 @@ char* copy_string(char* str){
   return copy;
 }
 
-/*
-  Get string from int
-*/
-char* string_from_int(int a){
-  int n=(a/10)+1;
-  if(n<0) n++;
-  char* msg=(char*)malloc(sizeof(char)*(n+1));
-  sprintf(msg,"%i",a);
-  return msg;
-}
-
 /*
   Initializes this module
 */
@@ -243,7 +395,7 @@ int require_file(char* filename,int step){
   if(step==STEP_TYPEDEF){
     FILE* f=fopen(copy,"r");
     if(!f){
-      add_error(-1,"cannot open file %s",copy);
+      add_error(-1,-1,"cannot open file %s",copy);
       remove_from_list(srcs,srcs->n-1);
       free(copy);
       return 1;
@@ -251,7 +403,7 @@ int require_file(char* filename,int step){
     List* ls=tokenize(f);
     fclose(f);
     if(!ls){
-      add_error(-1,"tokenization buffer overflow",NULL);
+      add_error(-1,-1,"tokenization buffer overflow",NULL);
       remove_from_list(srcs,srcs->n-1);
       free(copy);
       return 1;
@@ -295,6 +447,13 @@ int require_file(char* filename,int step){
 void moonshot_init(){
   line_written=0;
   requires=NULL;
+  max_tabs=0;
+  tabs=NULL;
+  for(int a=0;a<NUM_OPTIONS;a++) options[a]=0;
+  options[OPTION_INLINE_CALLS]=1;
+  error_limit=0;
+  num_errors=0;
+  reports=NULL;
   errors=NULL;
   _input=NULL;
   srcs=NULL;
@@ -306,6 +465,9 @@ void moonshot_init(){
 */
 void moonshot_destroy(){
   if(errors) dealloc_errors();
+  free(tabs);
+  tabs=NULL;
+  max_tabs=0;
 }
 
 /*
@@ -325,29 +487,32 @@ void moonshot_configure(FILE* input,FILE* output){
 int moonshot_compile(){
   if(!requires) init_requires();
   if(errors) dealloc_errors();
-  errors=new_default_list();
+  init_errors();
 
   // Tokenize
   List* ls=tokenize(_input);
   if(!ls){
-    add_error(-1,"tokenization buffer overflow",NULL);
+    add_error(-1,-1,"tokenization buffer overflow",NULL);
     return 0;
   }
 
   // Parse tokens
+  init_types_table();
   AstNode* root=parse(ls);
   if(!root){
     dealloc_token_buffer(ls);
+    dealloc_types_table();
     return 0;
   }
 
   // AST traversal
   init_traverse();
   traverse(root,STEP_CHECK);
-  if(!errors->n) traverse(root,STEP_OUTPUT);
+  if(!num_errors) traverse(root,STEP_OUTPUT);
   dealloc_traverse();
   dealloc_requires();
   dealloc_ast_node(root);
   dealloc_token_buffer(ls);
-  return (errors->n)?0:1;
+  dealloc_types_table();
+  return num_errors?0:1;
 }
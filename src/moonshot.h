@@ -1,8 +1,45 @@
 #include <stdio.h>
 #define VERSION "0.9.0 (beta)"
 
+// Options that can be set with moonshot_set_option
+enum MOONSHOT_OPTIONS{
+  OPTION_METATABLE_CLASSES, // Share class methods through metatables instead of per-instance closures
+  OPTION_HOIST_GLOBALS, // Read standard library globals through locals declared at the top of the chunk
+  OPTION_INLINE_CALLS, // Replace calls to small functions and final methods with their bodies (on by default)
+  NUM_OPTIONS
+};
+
+/*
+  MoonshotDiagnostic: a compilation problem in a form tools can consume
+*/
+typedef struct{
+  const char* severity; // Always "error" for now
+  const char* message; // Rendered message, without file or line suffixes
+  const char* file; // File the problem was found in, or NULL
+  unsigned int id; // Identifies the kind of message regardless of its arguments
+  int line; // -1 when the line is unknown
+  int column; // -1 when the column is unknown
+} MoonshotDiagnostic;
+
+/*
+  MoonshotStats: how much dead code the last compilation left out of its Lua output
+  Also how well type checking was served by its cache of typed_match results
+*/
+typedef struct{
+  int unreachable_statements; // Statements after a return, break or goto
+  int constant_branches; // if chain branches and while loops decided by a constant condition
+  int unused_locals; // Local definitions that are never read at runtime
+  int type_match_hits; // Type comparisons answered by the cache
+  int type_match_misses; // Type comparisons that had to walk the types graph
+} MoonshotStats;
+
+
 void moonshot_configure(FILE* input,FILE* output);
 void dummy_required_file(char* filename);
+void moonshot_set_option(int option,int value);
+void moonshot_set_max_errors(int max);
+MoonshotDiagnostic* moonshot_diagnostics(int* n);
+MoonshotStats moonshot_stats();
 char* moonshot_next_error();
 int moonshot_num_errors();
 void moonshot_destroy();
@@ -3,29 +3,102 @@
 #include <string.h>
 #include <assert.h>
 
+static Map* types_table; // Map of structural keys to canonical AST_TYPE_* AstNodes
+
 /*
-  Deallocates an AstNode with type AST_TYPE_*
+  Initializes the table of canonical type nodes
+  Must be called before anything is parsed
 */
-void dealloc_ast_type(AstNode* node){
-  if(node->type==AST_TYPE_FUNC){
-    AstListNode* data=(AstListNode*)(node->data);
-    if(data->node) dealloc_ast_type(data->node);
-    for(int a=0;a<data->list->n;a++){
-      AstNode* e=(AstNode*)get_from_list(data->list,a);
-      dealloc_ast_type(e);
+void init_types_table(){
+  types_table=new_default_map();
+}
+
+/*
+  Deallocates every canonical type node
+  Must be called after every AST that references them has been deallocated
+*/
+void dealloc_types_table(){
+  for(int a=0;a<types_table->n;a++){
+    AstNode* node=(AstNode*)iterate_from_map(types_table,a);
+    if(node->type==AST_TYPE_BASIC) free(node->data);
+    if(node->type==AST_TYPE_TUPLE) dealloc_list((List*)(node->data));
+    if(node->type==AST_TYPE_FUNC){
+      AstListNode* data=(AstListNode*)(node->data);
+      dealloc_list(data->list);
+      free(data);
     }
-    dealloc_list(data->list);
-    free(data);
+    free(types_table->data[a].k);
+    free(node);
   }
-  if(node->type==AST_TYPE_TUPLE){
-    List* ls=(List*)(node->data);
-    for(int a=0;a<ls->n;a++){
-      AstNode* e=(AstNode*)get_from_list(ls,a);
-      dealloc_ast_type(e);
+  dealloc_map(types_table);
+}
+
+/*
+  Builds the structural key of a type node
+  node is the return type for function types and NULL otherwise
+  ls is the list of child types for tuple and function types
+*/
+static char* type_key(char kind,AstNode* node,List* ls){
+  int n=ls?ls->n:0;
+  char* key=(char*)malloc(sizeof(char)*((n+1)*20+2));
+  int l=sprintf(key,"%c%p:",kind,(void*)node);
+  for(int a=0;a<n;a++) l+=sprintf(key+l,"%p,",get_from_list(ls,a));
+  return key;
+}
+
+/*
+  Returns the canonical type node for some key
+  Takes ownership of key and data, which are freed if the type already exists
+*/
+static AstNode* intern_type(char* key,int type,void* data){
+  AstNode* node=(AstNode*)get_from_map(types_table,key);
+  if(node){
+    free(key);
+    if(type==AST_TYPE_BASIC) free(data);
+    if(type==AST_TYPE_TUPLE) dealloc_list((List*)data);
+    if(type==AST_TYPE_FUNC){
+      dealloc_list(((AstListNode*)data)->list);
+      free(data);
     }
-    dealloc_list(ls);
+    return node;
   }
-  free(node);
+  node=new_node(type,-1,-1,data);
+  put_in_map(types_table,key,node);
+  return node;
+}
+
+/*
+  Hash-consing constructors for AST_TYPE_* nodes
+  There is exactly one node for each distinct type, so equal types are equal pointers
+  These nodes are immutable and owned by the types table, never free them
+*/
+AstNode* new_any_type(){
+  return intern_type(type_key('a',NULL,NULL),AST_TYPE_ANY,NULL);
+}
+AstNode* new_vararg_type(){
+  return intern_type(type_key('v',NULL,NULL),AST_TYPE_VARARG,NULL);
+}
+AstNode* new_basic_type(const char* name){
+  char* key=(char*)malloc(sizeof(char)*(strlen(name)+2));
+  sprintf(key,"b%s",name);
+  char* copy=(char*)malloc(sizeof(char)*(strlen(name)+1));
+  strcpy(copy,name);
+  return intern_type(key,AST_TYPE_BASIC,copy);
+}
+
+/*
+  ls is a List of canonical type nodes, and is owned by the result afterwards
+*/
+AstNode* new_tuple_type(List* ls){
+  return intern_type(type_key('t',NULL,ls),AST_TYPE_TUPLE,ls);
+}
+
+/*
+  ret is the canonical return type
+  args is a List of canonical type nodes, and is owned by the result afterwards
+*/
+AstNode* new_function_type(AstNode* ret,List* args){
+  return intern_type(type_key('f',ret,args),AST_TYPE_FUNC,new_ast_list_node(ret,args));
 }
 
 /*
@@ -33,7 +106,7 @@ void dealloc_ast_type(AstNode* node){
 */
 void dealloc_ast_node(AstNode* node){
   if(node->type==AST_TYPE_ANY || node->type==AST_TYPE_VARARG || node->type==AST_TYPE_FUNC || node->type==AST_TYPE_BASIC || node->type==AST_TYPE_TUPLE){
-    dealloc_ast_type(node);
+    // Type nodes are canonical and owned by the types table
     return;
   }
   if(node->type==AST_STMT || node->type==AST_DO || node->type==AST_ELSE){
@@ -44,9 +117,6 @@ void dealloc_ast_node(AstNode* node){
     }
     dealloc_list(ls);
   }
-  else if(node->type==AST_LTUPLE){
-    dealloc_list((List*)(node->data));
-  }
   else if(node->type==AST_RETURN || node->type==AST_PAREN || node->type==AST_REQUIRE || node->type==AST_SUPER || node->type==AST_LIST){
     if(node->data) dealloc_ast_node((AstNode*)(node->data));
   }
@@ -57,25 +127,24 @@ void dealloc_ast_node(AstNode* node){
   }
   else if(node->type==AST_PRIMITIVE){
     StringAstNode* data=(StringAstNode*)(node->data);
-    free(data->node->data);
-    free(data->node);
     free(data->text);
     free(data);
   }
   else if(node->type==AST_INTERFACE){
     InterfaceNode* data=(InterfaceNode*)(node->data);
-    dealloc_ast_type(data->type);
     for(int a=0;a<data->ls->n;a++){
       AstNode* e=get_from_list(data->ls,a);
       dealloc_ast_node(e);
     }
+    if(data->members) dealloc_members(data->members);
     dealloc_list(data->ls);
     free(data);
   }
   else if(node->type==AST_CLASS){
     ClassNode* data=(ClassNode*)(node->data);
+    if(data->members) dealloc_members(data->members);
+    if(data->layout) dealloc_class_layout(data->layout);
     dealloc_list(data->interfaces);
-    dealloc_ast_type(data->type);
     for(int a=0;a<data->ls->n;a++){
       AstNode* e=get_from_list(data->ls,a);
       dealloc_ast_node(e);
@@ -85,8 +154,6 @@ void dealloc_ast_node(AstNode* node){
   }
   else if(node->type==AST_FUNCTION){
     FunctionNode* data=(FunctionNode*)(node->data);
-    if(data->functype) dealloc_ast_type(data->functype);
-    if(data->type) dealloc_ast_type(data->type);
     if(data->name) dealloc_ast_node(data->name);
     if(data->body){
       for(int a=0;a<data->body->n;a++){
@@ -109,7 +176,7 @@ void dealloc_ast_node(AstNode* node){
     if(data->r) dealloc_ast_node(data->r);
     free(data);
   }
-  else if(node->type==AST_REPEAT || node->type==AST_WHILE || node->type==AST_TUPLE){
+  else if(node->type==AST_REPEAT || node->type==AST_WHILE || node->type==AST_TUPLE || node->type==AST_LTUPLE){
     AstListNode* data=(AstListNode*)(node->data);
     if(data->node) dealloc_ast_node(data->node);
     for(int a=0;a<data->list->n;a++){
@@ -173,9 +240,15 @@ void dealloc_ast_node(AstNode* node){
 /*
   Creates a new AstNode
 */
-AstNode* new_node(int type,int line,void* data){
+AstNode* new_node(int type,int line,int column,void* data){
   AstNode* node=(AstNode*)malloc(sizeof(AstNode));
+  node->cached_type=NULL;
+  node->resolution=RS_NONE;
+  node->visibility=VS_GLOBAL;
+  node->type_epoch=-1;
+  node->ref=NULL;
   node->line=line;
+  node->column=column;
   node->type=type;
   node->data=data;
   return node;
@@ -190,6 +263,9 @@ FunctionNode* new_function_node(AstNode* name,AstNode* type,List* args,List* bod
   FunctionNode* node=(FunctionNode*)malloc(sizeof(FunctionNode));
   node->is_constructor=0;
   node->functype=NULL;
+  node->reassigned=0;
+  node->is_final=0;
+  node->is_typed=0;
   node->name=name;
   node->args=args;
   node->type=type;
@@ -247,11 +323,9 @@ StringAstNode* new_string_ast_node(char* text,AstNode* ast){
   node->type is a AST_TYPE_BASIC node
 */
 StringAstNode* new_primitive_node(char* text,const char* type){
-  char* stype=(char*)malloc(strlen(type)+1);
-  strcpy(stype,type);
   char* stext=(char*)malloc(strlen(text)+1);
   strcpy(stext,text);
-  return new_string_ast_node(stext,new_node(AST_TYPE_BASIC,-1,stype));
+  return new_string_ast_node(stext,new_basic_type(type));
 }
 
 /*
@@ -299,8 +373,9 @@ BinaryNode* new_binary_node(char* text,AstNode* l,AstNode* r){
 */
 InterfaceNode* new_interface_node(char* name,char* parent,List* ls){
   InterfaceNode* node=(InterfaceNode*)malloc(sizeof(InterfaceNode));
-  node->type=new_node(AST_TYPE_BASIC,-1,name);
+  node->type=new_basic_type(name);
   node->parent=parent;
+  node->members=NULL;
   node->name=name;
   node->ls=ls;
   return node;
@@ -314,9 +389,12 @@ InterfaceNode* new_interface_node(char* name,char* parent,List* ls){
 */
 ClassNode* new_class_node(char* name,char* parent,List* interfaces,List* ls){
   ClassNode* node=(ClassNode*)malloc(sizeof(ClassNode));
-  node->type=new_node(AST_TYPE_BASIC,-1,name);
+  node->type=new_basic_type(name);
   node->interfaces=interfaces;
   node->parent=parent;
+  node->members=NULL;
+  node->layout=NULL;
+  node->is_final=0;
   node->name=name;
   node->ls=ls;
   return node;
@@ -352,8 +430,8 @@ EqualTypesNode* new_equal_types_node(char* name,AstNode* type,int relation,int s
 */
 BinaryNode* new_unary_node(char* op,AstNode* e){
   AstNode* type;
-  if(!strcmp(op,"trust")) type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_NIL);
-  else if(!strcmp(op,"#")) type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_INT);
-  else type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_BOOL);
+  if(!strcmp(op,"trust")) type=new_basic_type(PRIMITIVE_NIL);
+  else if(!strcmp(op,"#")) type=new_basic_type(PRIMITIVE_INT);
+  else type=new_basic_type(PRIMITIVE_BOOL);
   return new_binary_node(op,e,type);
 }
@@ -9,15 +9,17 @@
 #define UNARY_PRECEDENCE 6 // Precedence level for unary operators
 static List* tokens; // List of Tokens
 static int _i; // Index of the Token that's next to be consumed
+static int depth; // Number of statement blocks being parsed
+static int exports; // Number of definitions marked with export
 
 /*
   Wrapper for adding a compilation error
-  Pulls the line number from a Token
+  Pulls the line and column from a Token
 */
 static AstNode* error(Token* tk,const char* msg,...){
   va_list args;
   va_start(args,msg);
-  add_error_internal(tk?tk->line:-1,msg,args);
+  add_error_internal(tk?tk->line:-1,tk?tk->column:-1,msg,args);
   va_end(args);
   return NULL;
 }
@@ -67,6 +69,8 @@ static AstNode* error(Token* tk,const char* msg,...){
 */
 AstNode* parse(List* ls){
   _i=0;
+  depth=0;
+  exports=0;
   tokens=ls;
   AstNode* root=parse_stmt();
   if(root){
@@ -78,6 +82,14 @@ AstNode* parse(List* ls){
         return NULL;
       }
     }
+
+    // Files that export something keep the rest of their top-level definitions out of the global table
+    List* ls=(List*)(root->data);
+    for(int a=0;exports && a<ls->n;a++){
+      AstNode* e=(AstNode*)get_from_list(ls,a);
+      if(e->visibility==VS_EXPORTED) continue;
+      if(e->type==AST_DEFINE || e->type==AST_CLASS || e->type==AST_FUNCTION) e->visibility=VS_HIDDEN;
+    }
   }
   return root;
 }
@@ -142,6 +154,16 @@ static int specific(Token* tk,int type,const char* val){
   return tk && tk->type==type && !strcmp(tk->text,val);
 }
 
+/*
+  Returns 1 if the next Token is export marking a definition rather than a variable called export
+*/
+static int export_marker(){
+  if(!specific(check(),TK_NAME,"export")) return 0;
+  Token* tk=check_ahead(2);
+  if(expect(tk,TK_FUNCTION) || expect(tk,TK_CLASS) || expect(tk,TK_FINAL) || specific(tk,TK_BINARY,"*")) return 1;
+  return (expect(tk,TK_NAME) || expect(tk,TK_VAR)) && (expect(check_ahead(3),TK_NAME) || expect(check_ahead(3),TK_VAR));
+}
+
 /*
   Returns the precedence level of a binary operator
 */
@@ -159,17 +181,21 @@ static int precedence(char* op){
 // Statement block parsers
 AstNode* parse_stmt(){
   int line=-1;
+  int column=-1;
   Token* tk;
   AstNode* node;
   List* ls=new_default_list();
+  depth++;
   while(1){
     tk=check();
     if(!tk) break;
     if(line<0) line=tk->line;
+    if(column<0) column=tk->column;
     if(expect(tk,TK_FUNCTION)) node=parse_function(NULL,1);
+    else if(export_marker()) node=parse_export();
     else if(expect(tk,TK_IF)) node=parse_if();
     else if(expect(tk,TK_SUPER)) node=parse_super();
-    else if(expect(tk,TK_CLASS)) node=parse_class();
+    else if(expect(tk,TK_CLASS) || expect(tk,TK_FINAL)) node=parse_class();
     else if(expect(tk,TK_INTERFACE)) node=parse_interface();
     else if(expect(tk,TK_TYPEDEF)) node=parse_typedef();
     else if(expect(tk,TK_REQUIRE)) node=parse_require();
@@ -201,19 +227,45 @@ AstNode* parse_stmt(){
       break;
     }
     if(node) add_to_list(ls,node);
-    else FREE_AST_NODE_LIST(NULL,ls);
+    else{
+      depth--;
+      FREE_AST_NODE_LIST(NULL,ls);
+    }
   }
-  return new_node(AST_STMT,line,ls);
+  depth--;
+  return new_node(AST_STMT,line,column,ls);
 }
 AstNode* parse_do(){
   Token* tk=consume();
   if(!expect(tk,TK_DO)) return error(tk,"invalid do block",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* node=parse_stmt();
   if(!node) return NULL;
   tk=consume();
   if(!expect(tk,TK_END)) return error(tk,"unclosed do block",NULL);
-  return new_node(AST_DO,line,(List*)(node->data));
+  return new_node(AST_DO,line,column,(List*)(node->data));
+}
+
+AstNode* parse_export(){
+  Token* tk=consume();
+  if(!specific(tk,TK_NAME,"export")) return error(tk,"invalid export",NULL);
+  if(depth>1) return error(tk,"only top-level definitions can be exported",NULL);
+  AstNode* node;
+  tk=check();
+  if(expect(tk,TK_FUNCTION)) node=parse_function(NULL,1);
+  else if(expect(tk,TK_CLASS) || expect(tk,TK_FINAL)) node=parse_class();
+  else if(specific(tk,TK_BINARY,"*")) node=parse_function_or_define();
+  else if((expect(tk,TK_NAME) || expect(tk,TK_VAR)) && (expect(check_ahead(2),TK_NAME) || expect(check_ahead(2),TK_VAR))) node=parse_function_or_define();
+  else return error(tk,"only functions, classes and variables can be exported",NULL);
+  if(!node) return NULL;
+  if(node->type==AST_FUNCTION && (!((FunctionNode*)(node->data))->name || ((FunctionNode*)(node->data))->name->type!=AST_ID)){
+    error(tk,"only functions, classes and variables can be exported",NULL);
+    FREE_AST_NODE(NULL,node);
+  }
+  node->visibility=VS_EXPORTED;
+  exports++;
+  return node;
 }
 
 // Entity parsers (classes and interfaces)
@@ -222,6 +274,7 @@ AstNode* parse_interface(){
   Token* tk=consume();
   if(!expect(tk,TK_INTERFACE)) return error(tk,"invalid interface",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name for interface",NULL);
   char* name=tk->text;
@@ -243,22 +296,25 @@ AstNode* parse_interface(){
       if(!type) FREE_AST_NODE_LIST(NULL,ls);
     }
     AstNode* func=parse_function(type,0);
-    if(!func){
-      dealloc_ast_type(type);
-      FREE_AST_NODE_LIST(NULL,ls);
-    }
+    if(!func) FREE_AST_NODE_LIST(NULL,ls);
     add_to_list(ls,func);
     tk=check();
   }
   tk=consume();
   if(!expect(tk,TK_END)) FREE_AST_NODE_LIST(error(tk,"invalid interface %s",NULL),ls);
-  return new_node(AST_INTERFACE,line,new_interface_node(name,parent,ls));
+  return new_node(AST_INTERFACE,line,column,new_interface_node(name,parent,ls));
 }
 AstNode* parse_class(){
   char* parent=NULL;
+  int is_final=0;
   Token* tk=consume();
+  if(expect(tk,TK_FINAL)){
+    is_final=1;
+    tk=consume();
+  }
   if(!expect(tk,TK_CLASS)) return error(tk,"invalid class",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name for class",NULL);
   char* name=tk->text;
@@ -291,9 +347,23 @@ AstNode* parse_class(){
   List* ls=new_default_list();
   while(tk && !expect(tk,TK_END)){
     AstNode* node;
-    if(expect(tk,TK_CONSTRUCTOR)) node=parse_constructor(name);
+    int final_method=expect(tk,TK_FINAL);
+    if(final_method){
+      consume();
+      tk=check();
+    }
+    if(final_method && expect(tk,TK_CONSTRUCTOR)) node=error(tk,"constructor of class %s cannot be final",name);
+    else if(expect(tk,TK_CONSTRUCTOR)) node=parse_constructor(name);
     else if(expect(tk,TK_FUNCTION)) node=parse_function(NULL,1);
     else node=parse_function_or_define();
+    if(node && final_method){
+      if(node->type==AST_FUNCTION){
+        ((FunctionNode*)(node->data))->is_final=1;
+      }else{
+        dealloc_ast_node(node);
+        node=error(tk,"only methods of class %s can be final",name);
+      }
+    }
     if(!node){
       for(int a=0;a<ls->n;a++) dealloc_ast_node((AstNode*)get_from_list(ls,a));
       FREE_2_LISTS(NULL,interfaces,ls);
@@ -306,7 +376,9 @@ AstNode* parse_class(){
     for(int a=0;a<ls->n;a++) dealloc_ast_node((AstNode*)get_from_list(ls,a));
     FREE_2_LISTS(error(tk,"invalid class %s",name),interfaces,ls);
   }
-  return new_node(AST_CLASS,line,new_class_node(name,parent,interfaces,ls));
+  ClassNode* data=new_class_node(name,parent,interfaces,ls);
+  data->is_final=is_final;
+  return new_node(AST_CLASS,line,column,data);
 }
 
 // Type parsers
@@ -314,33 +386,30 @@ AstNode* parse_typedef(){
   Token* tk=consume();
   if(!expect(tk,TK_TYPEDEF)) return error(tk,"invalid typedef",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name for typedef",NULL);
   char* name=tk->text;
   AstNode* node=parse_type();
   if(!node) return NULL;
-  return new_node(AST_TYPEDEF,line,new_string_ast_node(name,node));
+  return new_node(AST_TYPEDEF,line,column,new_string_ast_node(name,node));
 }
 static AstNode* parse_basic_type(){
   Token* tk=check();
   if(expect(tk,TK_VAR)){
     consume();
-    return new_node(AST_TYPE_ANY,tk->line,NULL);
+    return new_any_type();
   }else if(expect(tk,TK_DOTS)){
     consume();
-    return new_node(AST_TYPE_VARARG,tk->line,NULL);
+    return new_vararg_type();
   }else if(expect(tk,TK_NAME)){
     consume();
-    return new_node(AST_TYPE_BASIC,tk->line,tk->text);
+    return new_basic_type(tk->text);
   }else if(specific(tk,TK_BINARY,"*")){
-    int line=tk->line;
     consume();
     AstNode* node=parse_type();
     if(!node) return NULL;
-    if(node->type==AST_TYPE_VARARG){
-      (node);
-      return error(tk,"invalid variadic member in function type",NULL);
-    }
+    if(node->type==AST_TYPE_VARARG) return error(tk,"invalid variadic member in function type",NULL);
     tk=check();
     while(specific(tk,TK_PAREN,"(")){
       consume();
@@ -348,19 +417,14 @@ static AstNode* parse_basic_type(){
       List* ls=new_default_list();
       while(tk && !specific(tk,TK_PAREN,")")){
         AstNode* arg=parse_type();
-        if(!arg){
-          for(int a=0;a<ls->n;a++) dealloc_ast_type((AstNode*)get_from_list(ls,a));
-          FREE_AST_NODE_AND_LIST(error(tk,"invalid function type",NULL),node,ls);
-        }
+        if(!arg) FREE_LIST(error(tk,"invalid function type",NULL),ls);
         add_to_list(ls,arg);
         tk=check();
         if(specific(tk,TK_MISC,",")) consume();
       }
-      node=new_node(AST_TYPE_FUNC,line,new_ast_list_node(node,ls));
+      node=new_function_type(node,ls);
       tk=consume();
-      if(!specific(tk,TK_PAREN,")")){
-        FREE_AST_NODE(error(tk,"unclosed function type",NULL),node);
-      }
+      if(!specific(tk,TK_PAREN,")")) return error(tk,"unclosed function type",NULL);
       tk=check();
     }
     return node;
@@ -370,34 +434,27 @@ static AstNode* parse_basic_type(){
 AstNode* parse_type(){
   Token* tk=check();
   if(specific(tk,TK_PAREN,"(")){
-    int line=tk->line;
     int commas=0;
     consume();
     AstNode* e=parse_basic_type();
     if(!e) return NULL;
-    if(e->type==AST_TYPE_VARARG){
-      dealloc_ast_type(e);
-      return error(tk,"invalid variadic member in tuple type",NULL);
-    }
+    if(e->type==AST_TYPE_VARARG) return error(tk,"invalid variadic member in tuple type",NULL);
     List* ls=new_default_list();
     add_to_list(ls,e);
     tk=check();
     while(specific(tk,TK_MISC,",")){
       consume();
       e=parse_basic_type();
-      if(!e) FREE_AST_NODE_LIST(NULL,ls);
-      if(e->type==AST_TYPE_VARARG){
-        (e);
-        FREE_AST_NODE_LIST(error(tk,"invalid variadic member in tuple type",NULL),ls);
-      }
+      if(!e) FREE_LIST(NULL,ls);
+      if(e->type==AST_TYPE_VARARG) FREE_LIST(error(tk,"invalid variadic member in tuple type",NULL),ls);
       add_to_list(ls,e);
       tk=check();
       commas++;
     }
     tk=consume();
-    if(!specific(tk,TK_PAREN,")")) FREE_AST_NODE_LIST(error(tk,"unclosed tuple type",NULL),ls);
-    if(!commas) FREE_AST_NODE_LIST(error(tk,"too few elements in tuple type",NULL),ls);
-    return new_node(AST_TYPE_TUPLE,line,ls);
+    if(!specific(tk,TK_PAREN,")")) FREE_LIST(error(tk,"unclosed tuple type",NULL),ls);
+    if(!commas) FREE_LIST(error(tk,"too few elements in tuple type",NULL),ls);
+    return new_tuple_type(ls);
   }
   return parse_basic_type();
 }
@@ -408,6 +465,7 @@ AstNode* parse_define(AstNode* type){
   Token* tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name for definition",NULL);
   int line=tk->line;
+  int column=tk->column;
   char* name=tk->text;
   tk=check();
   if(specific(tk,TK_MISC,"=")){
@@ -415,7 +473,7 @@ AstNode* parse_define(AstNode* type){
     expr=parse_expr();
     if(!expr) return NULL;
   }
-  return new_node(AST_DEFINE,line,new_binary_node(name,type,expr));
+  return new_node(AST_DEFINE,line,column,new_binary_node(name,type,expr));
 }
 AstNode* parse_set_or_call(){
   AstNode* lhs=parse_potential_tuple_lhs();
@@ -429,7 +487,7 @@ AstNode* parse_set_or_call(){
   if(!specific(tk,TK_MISC,"=")) FREE_AST_NODE(error(tk,"invalid set statement",NULL),lhs);
   AstNode* expr=parse_tuple();
   if(!expr) FREE_AST_NODE(NULL,lhs);
-  return new_node(AST_SET,lhs->line,new_ast_ast_node(lhs,expr));
+  return new_node(AST_SET,lhs->line,lhs->column,new_ast_ast_node(lhs,expr));
 }
 AstNode* parse_function_or_define(){
   AstNode* type=parse_type();
@@ -445,6 +503,7 @@ AstNode* parse_potential_tuple_lhs(){
   Token* tk=check();
   if(specific(tk,TK_MISC,",")){
     int line=tk->line;
+    int column=tk->column;
     if(node->type!=AST_ID) FREE_AST_NODE(error(tk,"Invalid left-hand entity in tuple",NULL),node);
     List* ls=new_default_list();
     add_to_list(ls,node);
@@ -452,10 +511,10 @@ AstNode* parse_potential_tuple_lhs(){
       consume();
       tk=consume();
       if(!expect(tk,TK_NAME)) FREE_AST_NODE_LIST(error(tk,"invalid left-hand tuple",NULL),ls);
-      add_to_list(ls,new_node(AST_ID,line,tk->text));
+      add_to_list(ls,new_node(AST_ID,line,column,tk->text));
       tk=check();
     }
-    return new_node(AST_LTUPLE,line,new_ast_list_node(NULL,ls));
+    return new_node(AST_LTUPLE,line,column,new_ast_list_node(NULL,ls));
   }
   return node;
 }
@@ -463,14 +522,15 @@ AstNode* parse_lhs(){
   Token* tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid left-hand side of statement",NULL);
   int line=tk->line;
-  AstNode* node=new_node(AST_ID,line,tk->text);
+  int column=tk->column;
+  AstNode* node=new_node(AST_ID,line,column,tk->text);
   tk=check_next();
   while(specific(tk,TK_MISC,".") || specific(tk,TK_SQUARE,"[")){
     if(specific(tk,TK_SQUARE,"[")){
       consume();
       AstNode* r=parse_expr();
       if(!r) FREE_AST_NODE(NULL,node);
-      node=new_node(AST_SUB,line,new_ast_ast_node(node,r));
+      node=new_node(AST_SUB,line,column,new_ast_ast_node(node,r));
       tk=consume();
       if(!specific(tk,TK_SQUARE,"]")) FREE_AST_NODE(error(tk,"invalid property",NULL),node);
     }
@@ -478,7 +538,7 @@ AstNode* parse_lhs(){
       consume();
       tk=consume();
       if(!expect(tk,TK_NAME)) FREE_AST_NODE(error(tk,"invalid field",NULL),node);
-      node=new_node(AST_FIELD,line,new_string_ast_node(tk->text,node));
+      node=new_node(AST_FIELD,line,column,new_string_ast_node(tk->text,node));
     }
     tk=check_next();
   }
@@ -489,6 +549,7 @@ AstNode* parse_local(){
   Token* tk=consume();
   if(!expect(tk,TK_LOCAL)) return error(tk,"invalid local variable declaration",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name for local variable",NULL);
   char* name=tk->text;
@@ -498,7 +559,7 @@ AstNode* parse_local(){
     node=parse_expr();
     if(!node) return NULL;
   }
-  return new_node(AST_LOCAL,line,new_string_ast_node(name,node));
+  return new_node(AST_LOCAL,line,column,new_string_ast_node(name,node));
 }
 
 // Function parsers
@@ -540,34 +601,34 @@ static List* parse_function_params(){
 }
 AstNode* parse_function(AstNode* type,int include_body){
   int line;
+  int column;
   Token* tk;
   int typed=(type!=NULL);
   if(!typed){
     tk=consume();
     if(!expect(tk,TK_FUNCTION)) return error(tk,"invalid function",NULL);
-    type=new_node(AST_TYPE_ANY,-1,NULL);
+    type=new_any_type();
   }
   AstNode* name=NULL;
   tk=check();
   if(expect(tk,TK_NAME)){
     line=tk->line;
+    column=tk->column;
     name=parse_lhs();
     if(!name){
-      if(!typed) free(type);
       return NULL;
     }
     if(typed && name->type!=AST_ID){
-      if(!typed) free(type);
       return error(tk,"cannot define typed methods outside of a class or interface",NULL);
     }
   }else if(typed){
     if(!expect(tk,TK_FUNCTION)) return error(tk,"invalid anonymous typed function",NULL);
     line=tk->line;
+    column=tk->column;
     consume();
   }
   List* args=parse_function_params();
   if(!args){
-    if(!typed) free(type);
     if(name) FREE_AST_NODE(NULL,name);
     return NULL;
   }
@@ -575,13 +636,11 @@ AstNode* parse_function(AstNode* type,int include_body){
   if(include_body){
     AstNode* node=parse_stmt();
     if(!node){
-      if(!typed) free(type);
       if(name) FREE_AST_NODE(NULL,name);
       FREE_STRING_AST_NODE_LIST(NULL,args);
     }
     tk=consume();
     if(!expect(tk,TK_END)){
-      if(!typed) free(type);
       dealloc_ast_node(node);
       if(name) FREE_AST_NODE(NULL,name);
       FREE_STRING_AST_NODE_LIST(error(tk,"unclosed function",NULL),args);
@@ -589,34 +648,38 @@ AstNode* parse_function(AstNode* type,int include_body){
     ls=(List*)(node->data);
     free(node);
   }
-  return new_node(AST_FUNCTION,line,new_function_node(name,type,args,ls));
+  FunctionNode* data=new_function_node(name,type,args,ls);
+  data->is_typed=typed;
+  return new_node(AST_FUNCTION,line,column,data);
 }
 AstNode* parse_constructor(char* classname){
   Token* tk=consume();
   if(!expect(tk,TK_CONSTRUCTOR)) return error(tk,"invalid constructor for class %s",classname);
   int line=tk->line;
+  int column=tk->column;
   List* args=parse_function_params();
   if(!args) return NULL;
   AstNode* node=parse_stmt();
   if(!node) FREE_AST_NODE_LIST(NULL,args);
   tk=consume();
   if(!expect(tk,TK_END)) FREE_AST_NODE_LIST(error(tk,"unclosed constructor for class %s",classname),args);
-  FunctionNode* data=new_function_node(NULL,new_node(AST_TYPE_BASIC,line,classname),args,(List*)(node->data));
+  FunctionNode* data=new_function_node(NULL,new_basic_type(classname),args,(List*)(node->data));
   data->is_constructor=1;
   free(node);
-  return new_node(AST_FUNCTION,line,data);
+  return new_node(AST_FUNCTION,line,column,data);
 }
 static AstNode* parse_arg_tuple(){
   AstNode* args=NULL;
   Token* tk=consume_next();
   if(!specific(tk,TK_PAREN,"(")) return error(tk,"invalid function call",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=check();
   if(tk && !specific(tk,TK_PAREN,")")){
     args=parse_tuple();
     if(!args) return NULL;
   }else{
-    args=new_node(AST_NONE,line,NULL);
+    args=new_node(AST_NONE,line,column,NULL);
   }
   tk=consume();
   if(!specific(tk,TK_PAREN,")")){
@@ -632,23 +695,25 @@ AstNode* parse_super(){
   Token* tk=consume();
   if(!expect(tk,TK_SUPER)) return error(tk,"invalid super method invocation",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* args=parse_arg_tuple();
   if(!args) return NULL;
   if(args->type==AST_NONE){
     free(args);
     args=NULL;
   }
-  return new_node(AST_SUPER,line,args);
+  return new_node(AST_SUPER,line,column,args);
 }
 AstNode* parse_call(AstNode* lhs){
   AstNode* args=parse_arg_tuple();
   if(!args) return NULL;
   int line=args->line;
+  int column=args->column;
   if(args->type==AST_NONE){
     free(args);
     args=NULL;
   }
-  return new_node(AST_CALL,line,new_ast_ast_node(lhs,args));
+  return new_node(AST_CALL,line,column,new_ast_ast_node(lhs,args));
 }
 
 // Conditional loop statements
@@ -656,18 +721,20 @@ AstNode* parse_repeat(){
   Token* tk=consume();
   if(!expect(tk,TK_REPEAT)) return error(tk,"invalid repeat statement",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* body=parse_stmt();
   if(!body) return NULL;
   tk=consume();
   if(!expect(tk,TK_UNTIL)) FREE_AST_NODE(error(tk,"repeat statement missing until keyword",NULL),body);
   AstNode* expr=parse_expr();
   if(!expr) FREE_AST_NODE(NULL,body);
-  return new_node(AST_REPEAT,line,new_ast_list_node(expr,(List*)(body->data)));
+  return new_node(AST_REPEAT,line,column,new_ast_list_node(expr,(List*)(body->data)));
 }
 AstNode* parse_while(){
   Token* tk=consume();
   if(!expect(tk,TK_WHILE)) return error(tk,"invalid while statement",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* expr=parse_expr();
   if(!expr) return NULL;
   tk=consume();
@@ -676,7 +743,7 @@ AstNode* parse_while(){
   if(!body) FREE_AST_NODE(NULL,expr);
   tk=consume();
   if(!expect(tk,TK_END)) FREE_2_AST_NODES(error(tk,"unclosed while statement",NULL),expr,body);
-  return new_node(AST_WHILE,line,new_ast_list_node(expr,(List*)(body->data)));
+  return new_node(AST_WHILE,line,column,new_ast_list_node(expr,(List*)(body->data)));
 }
 
 // If statements
@@ -685,6 +752,7 @@ AstNode* parse_if(){
   AstNode* next=NULL;
   if(!expect(tk,TK_IF)) return error(tk,"invalid if statement",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* expr=parse_expr();
   if(!expr) return NULL;
   tk=consume();
@@ -705,13 +773,14 @@ AstNode* parse_if(){
   }
   List* ls=(List*)(body->data);
   free(body);
-  return new_node(AST_IF,line,new_if_node(expr,next,ls));
+  return new_node(AST_IF,line,column,new_if_node(expr,next,ls));
 }
 AstNode* parse_elseif(){
   Token* tk=consume();
   AstNode* next=NULL;
   if(!expect(tk,TK_ELSEIF)) return error(tk,"invalid elseif clause",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* expr=parse_expr();
   if(!expr) return NULL;
   tk=consume();
@@ -732,12 +801,13 @@ AstNode* parse_elseif(){
   }
   List* ls=(List*)(body->data);
   free(body);
-  return new_node(AST_ELSEIF,line,new_if_node(expr,next,ls));
+  return new_node(AST_ELSEIF,line,column,new_if_node(expr,next,ls));
 }
 AstNode* parse_else(){
   Token* tk=consume();
   if(!expect(tk,TK_ELSE)) return error(tk,"invalid else clause",NULL);
   int line=tk->line;
+  int column=tk->column;
   AstNode* body=parse_stmt();
   if(!body) return NULL;
   tk=consume();
@@ -746,7 +816,7 @@ AstNode* parse_else(){
   }
   List* ls=(List*)(body->data);
   free(body);
-  return new_node(AST_ELSE,line,ls);
+  return new_node(AST_ELSE,line,column,ls);
 }
 
 // For statements
@@ -755,6 +825,7 @@ AstNode* parse_fornum(){
   AstNode *num1,*num2,*num3=NULL;
   if(!expect(tk,TK_FOR)) return error(tk,"invalid for loop",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid counter name in for loop",NULL);
   char* name=tk->text;
@@ -784,22 +855,23 @@ AstNode* parse_fornum(){
     if(num3) dealloc_ast_node(num3);
     FREE_2_AST_NODES(error(tk,"unclosed for loop with counter %s",name),num1,num2);
   }
-  return new_node(AST_FORNUM,line,new_fornum_node(name,num1,num2,num3,(List*)(body->data)));
+  return new_node(AST_FORNUM,line,column,new_fornum_node(name,num1,num2,num3,(List*)(body->data)));
 }
 AstNode* parse_forin(){
   Token* tk=consume();
   if(!expect(tk,TK_FOR)) return error(tk,"invalid for loop",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid name in for loop",NULL);
   List* lhs=new_default_list();
-  add_to_list(lhs,new_node(AST_ID,line,tk->text));
+  add_to_list(lhs,new_node(AST_ID,line,column,tk->text));
   tk=check();
   while(specific(tk,TK_MISC,",")){
     consume();
     tk=consume();
     if(!expect(tk,TK_NAME)) FREE_AST_NODE_LIST(error(tk,"invalid name in for loop",NULL),lhs);
-    add_to_list(lhs,new_node(AST_ID,line,tk->text));
+    add_to_list(lhs,new_node(AST_ID,line,column,tk->text));
     tk=check();
   }
   tk=consume();
@@ -822,8 +894,8 @@ AstNode* parse_forin(){
     dealloc_ast_node(tuple);
     FREE_AST_NODE_LIST(error(tk,"missing end keyword in for loop",NULL),lhs);
   }
-  AstNode* lhs_node=new_node(AST_LTUPLE,line,new_ast_list_node(NULL,lhs));
-  return new_node(AST_FORIN,line,new_forin_node(lhs_node,tuple,(List*)(body->data)));
+  AstNode* lhs_node=new_node(AST_LTUPLE,line,column,new_ast_list_node(NULL,lhs));
+  return new_node(AST_FORIN,line,column,new_forin_node(lhs_node,tuple,(List*)(body->data)));
 }
 
 // Label-based statements
@@ -831,47 +903,50 @@ AstNode* parse_label(){
   Token* tk=consume();
   if(!expect(tk,TK_DBCOLON)) return error(tk,"invalid label",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid label",NULL);
   char* text=tk->text;
   tk=consume();
   if(!expect(tk,TK_DBCOLON)) return error(tk,"invalid label",NULL);
-  return new_node(AST_LABEL,line,text);
+  return new_node(AST_LABEL,line,column,text);
 }
 AstNode* parse_goto(){
   Token* tk=consume();
   if(!expect(tk,TK_GOTO)) return error(tk,"invalid goto statement",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=consume();
   if(!expect(tk,TK_NAME)) return error(tk,"invalid goto statement",NULL);
   char* text=tk->text;
-  return new_node(AST_GOTO,line,text);
+  return new_node(AST_GOTO,line,column,text);
 }
 
 // Basic control statements
 AstNode* parse_break(){
   Token* tk=consume();
   if(!expect(tk,TK_BREAK)) return error(tk,"invalid break",NULL);
-  return new_node(AST_BREAK,tk->line,NULL);
+  return new_node(AST_BREAK,tk->line,tk->column,NULL);
 }
 AstNode* parse_require(){
   Token* tk=consume();
   if(!expect(tk,TK_REQUIRE)) return error(tk,"invalid require statement",NULL);
   AstNode* expr=parse_string();
   if(!expr) return NULL;
-  return new_node(AST_REQUIRE,tk->line,expr);
+  return new_node(AST_REQUIRE,tk->line,tk->column,expr);
 }
 AstNode* parse_return(){
   AstNode* node=NULL;
   Token* tk=consume();
   if(!expect(tk,TK_RETURN)) return error(tk,"invalid return statement",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=check();
   if(!expect(tk,TK_END)){
     node=parse_tuple();
     if(!node) return NULL;
   }
-  return new_node(AST_RETURN,line,node);
+  return new_node(AST_RETURN,line,column,node);
 }
 
 // Parse tables and lists
@@ -879,10 +954,11 @@ AstNode* parse_table_or_list(){
   Token* tk=consume();
   if(!specific(tk,TK_CURLY,"{")) return error(tk,"invalid table",NULL);
   int line=tk->line;
+  int column=tk->column;
   tk=check();
   if(specific(tk,TK_CURLY,"}")){
     consume();
-    return new_node(AST_LIST,line,NULL);
+    return new_node(AST_LIST,line,column,NULL);
   }
   tk=check_ahead(2);
   if(specific(tk,TK_MISC,"=")){
@@ -899,7 +975,7 @@ AstNode* parse_list(){
     else error(tk,"unclosed list",NULL);
     FREE_AST_NODE(NULL,tuple);
   }
-  return new_node(AST_LIST,tk->line,tuple);
+  return new_node(AST_LIST,tk->line,tk->column,tuple);
 }
 AstNode* parse_table(){
   List* keys=new_default_list();
@@ -907,6 +983,7 @@ AstNode* parse_table(){
   Token* tk=consume();
   assert(tk);
   int line=tk->line;
+  int column=tk->column;
   while(tk && !specific(tk,TK_CURLY,"}")){
     if(!expect(tk,TK_NAME)){
       dealloc_list(keys);
@@ -938,7 +1015,7 @@ AstNode* parse_table(){
     dealloc_list(keys);
     FREE_AST_NODE_LIST(error(tk,"unclosed table",NULL),vals);
   }
-  return new_node(AST_TABLE,line,new_table_node(keys,vals));
+  return new_node(AST_TABLE,line,column,new_table_node(keys,vals));
 }
 
 // Primitive types parse functions
@@ -946,6 +1023,7 @@ AstNode* parse_string(){
   Token* tk=consume();
   if(!expect(tk,TK_QUOTE)) return error(tk,"invalid string",NULL);
   int line=tk->line;
+  int column=tk->column;
   List* buffer=new_default_list();
   add_to_list(buffer,tk->text);
   Token* begin=tk;
@@ -958,7 +1036,7 @@ AstNode* parse_string(){
   else FREE_LIST(error(begin,"unclosed string",NULL),buffer);
   char* string=collapse_string_list(buffer);
   dealloc_list(buffer);
-  AstNode* node=new_node(AST_PRIMITIVE,line,new_primitive_node(string,PRIMITIVE_STRING));
+  AstNode* node=new_node(AST_PRIMITIVE,line,column,new_primitive_node(string,PRIMITIVE_STRING));
   free(string);
   return node;
 }
@@ -974,19 +1052,19 @@ AstNode* parse_number(){
     if(!expect(tk,TK_INT)) return error(tk,"invalid floating point primitive",NULL);
     char* text=(char*)malloc(sizeof(char)*(strlen(first->text)+strlen(tk->text)+2));
     sprintf(text,"%s.%s",first->text,tk->text);
-    return new_node(AST_PRIMITIVE,first->line,new_primitive_node(text,PRIMITIVE_FLOAT));
+    return new_node(AST_PRIMITIVE,first->line,first->column,new_primitive_node(text,PRIMITIVE_FLOAT));
   }
-  return new_node(AST_PRIMITIVE,first->line,new_primitive_node(first->text,PRIMITIVE_INT));
+  return new_node(AST_PRIMITIVE,first->line,first->column,new_primitive_node(first->text,PRIMITIVE_INT));
 }
 AstNode* parse_boolean(){
   Token* tk=consume();
   if(!expect(tk,TK_TRUE) && !expect(tk,TK_FALSE)) return error(tk,"invalid boolean primitive",NULL);
-  return new_node(AST_PRIMITIVE,tk->line,new_primitive_node(tk->text,PRIMITIVE_BOOL));
+  return new_node(AST_PRIMITIVE,tk->line,tk->column,new_primitive_node(tk->text,PRIMITIVE_BOOL));
 }
 AstNode* parse_nil(){
   Token* tk=consume();
   if(!expect(tk,TK_NIL)) return error(tk,"invalid nil",NULL);
-  return new_node(AST_PRIMITIVE,tk->line,new_primitive_node("nil",PRIMITIVE_NIL));
+  return new_node(AST_PRIMITIVE,tk->line,tk->column,new_primitive_node("nil",PRIMITIVE_NIL));
 }
 
 // Expression parse functions
@@ -994,6 +1072,7 @@ AstNode* parse_tuple(){
   AstNode* node=parse_expr();
   if(!node) return NULL;
   int line=node->line;
+  int column=node->column;
   List* ls=new_default_list();
   add_to_list(ls,node);
   Token* tk=check();
@@ -1004,15 +1083,17 @@ AstNode* parse_tuple(){
     add_to_list(ls,node);
     tk=check();
   }
-  return new_node(AST_TUPLE,line,new_ast_list_node(NULL,ls));
+  return new_node(AST_TUPLE,line,column,new_ast_list_node(NULL,ls));
 }
 AstNode* parse_paren_or_tuple_function(){
   int line;
+  int column;
   Token* tk=check_ahead(2);
   if(specific(tk,TK_BINARY,"*")){
     AstNode* type=parse_type();
     if(!type) return NULL;
     line=type->line;
+    column=type->column;
     return parse_function(type,1);
   }
   if(expect(tk,TK_NAME)){
@@ -1021,6 +1102,7 @@ AstNode* parse_paren_or_tuple_function(){
       AstNode* type=parse_type();
       if(!type) return NULL;
       line=type->line;
+      column=type->column;
       return parse_function(type,1);
     }
   }
@@ -1029,18 +1111,23 @@ AstNode* parse_paren_or_tuple_function(){
   if(!node) return NULL;
   tk=consume();
   if(!specific(tk,TK_PAREN,")")) FREE_AST_NODE(error(tk,"unclosed expression",NULL),node);
-  return new_node(AST_PAREN,line,node);
+  return new_node(AST_PAREN,line,column,node);
 }
+/*
+  Regroups a binary expression whose right operand was parsed greedily
+  The tree ends up grouped like Lua groups the same text, with only .. and ^ associating to the right
+*/
 static AstNode* precede_expr_tree(BinaryNode* data){
-  if(data->r->type!=AST_BINARY) return new_node(AST_BINARY,-1,data);
+  if(data->r->type!=AST_BINARY) return new_node(AST_BINARY,-1,-1,data);
   BinaryNode* r=(BinaryNode*)(data->r->data);
   int lp=precedence(data->text);
   int rp=precedence(r->text);
-  if(lp>rp){
+  int right=!strcmp(data->text,"..") || !strcmp(data->text,"^");
+  if(lp>rp || (lp==rp && !right)){
     AstNode* l=precede_expr_tree(new_binary_node(data->text,data->l,r->l));
-    return new_node(AST_BINARY,-1,new_binary_node(r->text,l,r->r));
+    return new_node(AST_BINARY,-1,-1,new_binary_node(r->text,l,r->r));
   }
-  return new_node(AST_BINARY,-1,data);
+  return new_node(AST_BINARY,-1,-1,data);
 }
 AstNode* parse_expr(){
   Token* tk=check();
@@ -1083,9 +1170,9 @@ AstNode* parse_expr(){
         while(data->l->type==AST_BINARY && precedence(((BinaryNode*)(data->l->data))->text)<UNARY_PRECEDENCE){
           data=(BinaryNode*)(data->l->data);
         }
-        data->l=new_node(AST_UNARY,node->line,new_unary_node(text,data->l));
-      }else node=new_node(AST_UNARY,node->line,new_unary_node(text,node));
-    }else node=new_node(AST_UNARY,node->line,new_unary_node(text,node));
+        data->l=new_node(AST_UNARY,node->line,node->column,new_unary_node(text,data->l));
+      }else node=new_node(AST_UNARY,node->line,node->column,new_unary_node(text,node));
+    }else node=new_node(AST_UNARY,node->line,node->column,new_unary_node(text,node));
   }
 
   // Check for binary expressions
@@ -15,8 +15,10 @@ static Scope* new_scope(int type,void* data){
   scope->classes_registry=new_default_list();
   scope->types_registry=new_default_list();
   scope->defs=new_default_list();
+  scope->decls=new_default_list();
   scope->type=type;
   scope->data=data;
+  invalidate_cached_types();
   return scope;
 }
 
@@ -63,19 +65,18 @@ void push_scope(){
 */
 void pop_scope(){
   Scope* scope=remove_from_list(scopes,scopes->n-1);
+  invalidate_cached_types();
   for(int a=0;a<scope->defs->n;a++){
     StringAstNode* var=(StringAstNode*)get_from_list(scope->defs,a);
     if(scope->type==SCOPE_CLASS && !strcmp(var->text,"this") && var->node->type==AST_TYPE_BASIC){
       ClassNode* class=(ClassNode*)(scope->data);
       char* type=(char*)(var->node->data);
-      if(!strcmp(class->name,type)){
-        free(var->text);
-        free(var->node);
-      }
+      if(!strcmp(class->name,type)) free(var->text);
     }
     free(var);
   }
   dealloc_list(scope->defs);
+  dealloc_list(scope->decls);
   for(int a=0;a<scope->types_registry->n;a++){
     char* type=(char*)get_from_list(scope->types_registry,a);
     if(!strcmp(type,PRIMITIVE_STRING) || !strcmp(type,PRIMITIVE_FLOAT) || !strcmp(type,PRIMITIVE_BOOL) || !strcmp(type,PRIMITIVE_INT) || !strcmp(type,PRIMITIVE_NIL)){
@@ -144,12 +145,10 @@ void push_class_scope(ClassNode* node){
   add_to_list(scopes,new_scope(SCOPE_CLASS,node));
   char* this=(char*)malloc(sizeof(char)*5);
   sprintf(this,"this");
-  AstNode* type=new_node(AST_TYPE_BASIC,-1,node->name);
-  StringAstNode* var=new_string_ast_node(this,type);
+  StringAstNode* var=new_string_ast_node(this,new_basic_type(node->name));
   if(!add_scoped_var(var)){
     // This should never ever happen
     assert(0);
-    free(type);
     free(this);
     free(var);
   }
@@ -182,6 +181,7 @@ int add_scoped_var(StringAstNode* node){
     }
   }
   add_to_list(scope->defs,node);
+  invalidate_cached_types();
   return 1;
 }
 
@@ -250,6 +250,7 @@ void register_primitive(const char* name){
 void register_type(char* name){
   Scope* scope=get_scope();
   add_to_list(scope->types_registry,name);
+  invalidate_cached_types();
 }
 
 /*
@@ -258,6 +259,7 @@ void register_type(char* name){
 void register_function(FunctionNode* node){
   Scope* scope=get_scope();
   add_to_list(scope->functions_registry,node);
+  invalidate_cached_types();
 }
 
 /*
@@ -266,6 +268,7 @@ void register_function(FunctionNode* node){
 void register_interface(InterfaceNode* node){
   Scope* scope=get_scope();
   add_to_list(scope->interfaces_registry,node);
+  invalidate_cached_types();
 }
 
 /*
@@ -274,6 +277,7 @@ void register_interface(InterfaceNode* node){
 void register_class(ClassNode* node){
   Scope* scope=get_scope();
   add_to_list(scope->classes_registry,node);
+  invalidate_cached_types();
 }
 
 /*
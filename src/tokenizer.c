@@ -36,8 +36,9 @@ void dealloc_token(Token* tk){
 
 /*
   Generates tokens from a buffer of similarly-classes characters
+  column is the column of the buffer's first character
 */
-static void discover_tokens(List* ls,int line,char* buffer,int n,int char_class){
+static void discover_tokens(List* ls,int line,int column,char* buffer,int n,int char_class){
   buffer[n]=0;
   if(char_class!=class_special){
 
@@ -56,6 +57,7 @@ static void discover_tokens(List* ls,int line,char* buffer,int n,int char_class)
     strcpy(tk->text,buffer);
     add_to_list(ls,tk);
     tk->line=line;
+    tk->column=column;
     if(char_class==class_whitespace) tk->type=TK_SPACE;
     else{
       if(!strcmp(buffer,"and")) tk->type=TK_BINARY;
@@ -128,6 +130,7 @@ static void discover_tokens(List* ls,int line,char* buffer,int n,int char_class)
       Token* tk=(Token*)malloc(sizeof(Token));
       tk->text=NULL;
       tk->line=line;
+      tk->column=column+a;
       if(n-a>=3 && !strncmp(buffer+a,"...",3)){
         tk->text=(char*)malloc(sizeof(char)*4);
         sprintf(tk->text,"...");
@@ -173,6 +176,8 @@ static void discover_tokens(List* ls,int line,char* buffer,int n,int char_class)
 */
 List* tokenize(FILE* f){
   int line=1;
+  int column=1; // Column of the next character
+  int start=1; // Column of the first character in the buffer
   if(!f) return NULL;
   int current_class=-1;
   List* ls=new_list(100);
@@ -181,15 +186,17 @@ List* tokenize(FILE* f){
   while(1){
     char c=fgetc(f);
     if(feof(f)){
-      if(i) discover_tokens(ls,line,buffer,i,current_class);
+      if(i) discover_tokens(ls,line,start,buffer,i,current_class);
       break;
     }
     int char_class=get_char_class(c);
     if(current_class!=-1 && char_class!=current_class){
-      discover_tokens(ls,line,buffer,i,current_class);
+      discover_tokens(ls,line,start,buffer,i,current_class);
       i=0;
     }
     current_class=char_class;
+    if(!i) start=column;
+    column=(c=='\n')?1:column+1;
     if(c=='\n') line++;
     if(i==TOKEN_BUFFER_LENGTH){
       for(int a=0;a<ls->n;a++) dealloc_token((Token*)get_from_list(ls,a));
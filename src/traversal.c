@@ -1,18 +1,41 @@
+#include "./moonshot.h"
 #include "./internal.h"
 #include <assert.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#define ERROR(cond,line,msg,...) if(cond){assert(step!=STEP_OUTPUT);add_error(line,msg,__VA_ARGS__);return;}
+#define OUTPUT_FLUSH_LENGTH 65536 // Number of buffered output bytes that triggers a write
+#define MAX_CHUNK_LOCALS 180 // Most locals in the chunk's main function, leaving room below Lua's limit of 200
+#define MAX_INLINED_NODES 12 // Most AST nodes in a returned expression that replaces a call
+#define ERROR(cond,at,msg,...) if(cond){assert(step!=STEP_OUTPUT);add_error(at->line,at->column,msg,__VA_ARGS__);return;}
 static char* instance_str; // The variable used for the produced object in constructors
 static FILE* _output; // The configured output as desired by the developer
+static Buffer* output_buffer; // Lua code waiting to be written to the output
+static Map* hidden; // Names to declare as locals at the top of the chunk, mapped to NULL once they don't fit
+static int chunk_locals; // Locals the chunk itself declares outside of functions
+static Map* mentions; // Number of AST_ID nodes with each name, keyed by name
+static Map* bindings; // Number of definitions and assignments of each plain name, keyed by name
+static Map* assigned_fields; // Names of fields that the chunk assigns to
 static int step; // The traversal step you're currently processing
 static int num_indents; // Number of tabs on the output line
+static ClassNode* parent_class; // Parent of the class being traversed, if any
+static int resolving; // 1 if the check step should record name resolutions for output
+static int eliminated[NUM_ELIMINATIONS]; // Number of each kind of code left out of the output
+static int operand; // 1 while the node about to be written is an operand of an operator
+static AstNode* statement; // Statement being written, whose own call can't be replaced by an expression
+static FunctionNode* inlined; // Function whose returned expression is being written in place of a call
+static AstNode* inline_receiver; // Instance the inlined method is called on, or NULL for functions
+static List* inline_args; // Arguments of the inlined call
 static AstNode* float_type; // AstNode constant representing the FLOAT type
 static AstNode* bool_type; // AstNode constant representing the BOOL type
 static AstNode* int_type; // AstNode constant representing the INT type
 static AstNode* any_type; // AstNode constant representing the ANY type
+static int limit_hidden_definitions(int room);
+static void write_hidden_definitions();
+static void declare_upfront(char* name);
+static void write_hoisted_globals(int room);
 
 /*
   The traversal step of this compiler has 4 phases:
@@ -21,6 +44,7 @@ static AstNode* any_type; // AstNode constant representing the ANY type
   The relate phase is where we go through each type and register any equivalencies (since the types need to exist first)
   The check phase is when we perform general compile-time checks
   The output phase happen after all checks have been performed, this is when we write Lua code to output
+  Scopes only exist during the check phase, which records what the output phase needs on the AstNodes
 */
 
 // Get number of indents
@@ -28,6 +52,11 @@ int get_num_indents(){
   return num_indents;
 }
 
+// Get how much of some kind of code was left out of the output (check enum Eliminations)
+int num_eliminated(int kind){
+  return eliminated[kind];
+}
+
 // Constant primitive type AstNodes access
 AstNode* float_type_const(){
   return float_type;
@@ -47,13 +76,26 @@ AstNode* any_type_const(){
 */
 void init_traverse(){
   instance_str=(char*)malloc(sizeof(char)*6);
-  float_type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_FLOAT);
-  bool_type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_BOOL);
-  int_type=new_node(AST_TYPE_BASIC,-1,PRIMITIVE_INT);
-  any_type=new_node(AST_TYPE_ANY,-1,NULL);
-  sprintf(instance_str,"__obj");
+  float_type=new_basic_type(PRIMITIVE_FLOAT);
+  bool_type=new_basic_type(PRIMITIVE_BOOL);
+  int_type=new_basic_type(PRIMITIVE_INT);
+  any_type=new_any_type();
+  sprintf(instance_str,moonshot_option(OPTION_METATABLE_CLASSES)?"self":"__obj");
+  output_buffer=new_buffer(OUTPUT_FLUSH_LENGTH);
+  hidden=new_default_map();
+  chunk_locals=0;
+  mentions=new_default_map();
+  bindings=new_default_map();
+  assigned_fields=new_default_map();
+  for(int a=0;a<NUM_ELIMINATIONS;a++) eliminated[a]=0;
+  statement=NULL;
+  operand=0;
+  inlined=NULL;
   num_indents=0;
+  resolving=1;
   preempt_scopes();
+  init_hoisting();
+  init_folding();
   init_types();
   init_scopes();
   push_scope();
@@ -65,22 +107,42 @@ void init_traverse(){
 */
 void traverse(AstNode* root,int initial_step){
   step=initial_step;
+  if(step==STEP_OUTPUT){
+    // Hidden definitions, direct methods and hoisted aliases share what's left of the main function's locals
+    int room=limit_hidden_definitions(MAX_CHUNK_LOCALS-chunk_locals);
+    if(moonshot_option(OPTION_HOIST_GLOBALS)) write_hoisted_globals(room);
+    write_hidden_definitions();
+  }
   process_node_list((List*)(root->data));
+  if(step==STEP_OUTPUT) flush_buffer(output_buffer,_output);
 }
 
 /*
   Deallocate resources used by the traversal module
 */
 void dealloc_traverse(){
+  for(int a=0;a<hidden->n;a++) free(hidden->data[a].k);
+  for(int a=0;a<mentions->n;a++){
+    free(mentions->data[a].k);
+    free(mentions->data[a].v);
+  }
+  dealloc_map(mentions);
+  for(int a=0;a<bindings->n;a++){
+    free(bindings->data[a].k);
+    free(bindings->data[a].v);
+  }
+  dealloc_map(bindings);
+  for(int a=0;a<assigned_fields->n;a++) free(iterate_from_map(assigned_fields,a));
+  dealloc_map(assigned_fields);
+  dealloc_buffer(output_buffer);
+  dealloc_map(hidden);
   free(instance_str);
   pop_scope();
   assert(get_num_scopes()==0);
+  dealloc_hoisting();
+  dealloc_folding();
   dealloc_scopes();
   dealloc_types();
-  free(any_type);
-  free(int_type);
-  free(bool_type);
-  free(float_type);
 }
 
 /*
@@ -101,14 +163,14 @@ static void indent(int a){
 
 /*
   Writes a message to the configured output
+  Output is buffered and written out whenever the buffer fills up
 */
 static void write(const char* msg,...){
   if(step==STEP_OUTPUT){
     va_list args;
     va_start(args,msg);
-    char* str=format_string(1,msg,args);
-    fprintf(_output,"%s",str);
-    free(str);
+    format_to_buffer(output_buffer,1,msg,args);
+    if(output_buffer->n>=OUTPUT_FLUSH_LENGTH) flush_buffer(output_buffer,_output);
     va_end(args);
   }
 }
@@ -120,6 +182,7 @@ static void conditional_newline(AstNode* node){
   if(step==STEP_OUTPUT){
     if(node->type==AST_FUNCTION) write("\n");
     if(node->type==AST_CALL) write("\n");
+    if(node->type==AST_SUPER && moonshot_option(OPTION_METATABLE_CLASSES)) write("\n");
     if(node->type==AST_REQUIRE){
       AstNode* data=(AstNode*)(node->data);
       assert(data->type==AST_PRIMITIVE); // data is AST_PRIMITIVE with type string
@@ -136,6 +199,588 @@ static void conditional_newline(AstNode* node){
   }
 }
 
+/*
+  Enter and exit block scopes, which are only tracked during the check step
+*/
+static void enter_scope(){
+  if(step==STEP_CHECK) push_scope();
+}
+static void exit_scope(){
+  if(step==STEP_CHECK) pop_scope();
+}
+
+/*
+  Returns 1 if a member of a class's flattened layout is declared by the class itself
+  Names within inherited members are resolved when their own class is checked
+*/
+static int declared_by_class(ClassNode* data,AstNode* child){
+  char* name;
+  if(child->type==AST_DEFINE) name=((BinaryNode*)(child->data))->text;
+  else name=(char*)(((FunctionNode*)(child->data))->name->data);
+  MemberNode* member=(MemberNode*)get_from_map(get_class_members(data),name);
+  return member && member->entity==data;
+}
+
+/*
+  Keeps a variable from being replaced by its constant value where Lua needs a prefix expression
+  A literal can't be called, indexed or have its fields read without parentheses
+*/
+static void unfoldable_prefix(AstNode* node){
+  if(node->type==AST_ID && node->resolution==RS_NONE) node->ref=NULL;
+}
+
+/*
+  Records that a statement assigns to the variable at the root of a target expression
+  Assigning to a field of a library table changes what the aliases of its fields should hold
+*/
+static void assigns_global(AstNode* target){
+  while(target->type==AST_FIELD || target->type==AST_SUB){
+    if(target->type==AST_FIELD) target=((StringAstNode*)(target->data))->node;
+    else target=((AstAstNode*)(target->data))->l;
+  }
+  if(target->type==AST_ID) mark_global_assigned((char*)(target->data));
+  if(target->type==AST_LTUPLE){
+    List* ls=((AstListNode*)(target->data))->list;
+    for(int a=0;a<ls->n;a++) assigns_global((AstNode*)get_from_list(ls,a));
+  }
+}
+
+/*
+  Adds one to the number kept for a name, such as how many AST_ID nodes use it
+  Only called during the check step
+*/
+static void count_name(Map* counts,char* name){
+  int* n=(int*)get_from_map(counts,name);
+  if(!n){
+    n=(int*)malloc(sizeof(int));
+    *n=0;
+    put_in_map(counts,copy_string(name),n);
+  }
+  (*n)++;
+}
+
+/*
+  Stops a typed function from being inlined because a statement assigns something else to its name
+*/
+static void reassigns_function(AstNode* target){
+  FunctionNode* func=(target->type==AST_ID)?function_exists((char*)(target->data)):NULL;
+  if(func) func->reassigned=1;
+  if(target->type==AST_ID) count_name(bindings,(char*)(target->data));
+  if(target->type==AST_LTUPLE){
+    List* ls=((AstListNode*)(target->data))->list;
+    for(int a=0;a<ls->n;a++) reassigns_function((AstNode*)get_from_list(ls,a));
+  }
+}
+
+/*
+  Records that a set statement assigns to method fields, which then stop being read as bound methods
+  Only called during the check step
+*/
+static void assigns_method(AstNode* target){
+  if(target->type==AST_FIELD && target->resolution==RS_METHOD) target->resolution=RS_ASSIGNED;
+  if(target->type==AST_LTUPLE){
+    List* ls=((AstListNode*)(target->data))->list;
+    for(int a=0;a<ls->n;a++) assigns_method((AstNode*)get_from_list(ls,a));
+  }
+}
+
+/*
+  Records the names of fields that a statement assigns to
+  Calls of methods with those names keep looking the method up, since the field might hold something else
+*/
+static void assigns_field(AstNode* target){
+  if(target->type==AST_FIELD){
+    char* name=((StringAstNode*)(target->data))->text;
+    if(!get_from_map(assigned_fields,name)){
+      char* copy=copy_string(name);
+      put_in_map(assigned_fields,copy,copy);
+    }
+  }
+  if(target->type==AST_LTUPLE){
+    List* ls=((AstListNode*)(target->data))->list;
+    for(int a=0;a<ls->n;a++) assigns_field((AstNode*)get_from_list(ls,a));
+  }
+}
+
+/*
+  Returns 1 if a call that the check step devirtualized can still skip looking up its method
+  Only meaningful during the output step, once every assignment has been seen
+*/
+static int direct_call(AstNode* call){
+  if(call->resolution!=RS_DIRECT) return 0;
+  StringAstNode* field=(StringAstNode*)(((AstAstNode*)(call->data))->l->data);
+  return !get_from_map(assigned_fields,field->text);
+}
+
+/*
+  Writes the values of a set statement
+  Metatable classes call method fields with the instance first, so functions assigned to them are wrapped to drop it
+*/
+static void write_set_values(AstNode* targets,AstNode* values){
+  List* ls=(targets->type==AST_LTUPLE)?((AstListNode*)(targets->data))->list:NULL;
+  List* vals=((AstListNode*)(values->data))->list;
+  for(int a=0;a<vals->n;a++){
+    AstNode* target=ls?((a<ls->n)?(AstNode*)get_from_list(ls,a):NULL):(a?NULL:targets);
+    int wrapped=target && target->resolution==RS_ASSIGNED;
+    if(a) write(",");
+    if(wrapped) write("(function(f) return f and function(_,...) return f(...) end end)(");
+    process_node((AstNode*)get_from_list(vals,a));
+    if(wrapped) write(")");
+  }
+}
+
+/*
+  Records that the chunk declares some number of locals, if it does so in its main function
+  Only called during the check step
+*/
+static void declares_chunk_locals(int n){
+  if(resolving && !get_function_scope() && !get_class_scope()) chunk_locals+=n;
+}
+
+/*
+  Records a name to declare as a local at the top of the chunk
+*/
+static void declare_upfront(char* name){
+  if(get_from_map(hidden,name)) return;
+  char* copy=copy_string(name);
+  put_in_map(hidden,copy,copy);
+}
+
+/*
+  Records a top-level definition that isn't exported so it can be declared as a local
+  Only called during the check step
+*/
+static void hide_definition(AstNode* node,char* name){
+  if(node->visibility!=VS_HIDDEN || get_num_scopes()>1) return;
+  declare_upfront(name);
+}
+
+/*
+  Returns 1 if a statement defines a hidden top-level function that nothing else names
+  Its local can't be reached from outside the chunk, so the definition can be left out
+  Only meaningful during the output step
+*/
+static int unused_function(AstNode* node){
+  if(node->type!=AST_FUNCTION || node->visibility!=VS_HIDDEN) return 0;
+  AstNode* name=((FunctionNode*)(node->data))->name;
+  if(!name || name->type!=AST_ID || !get_from_map(hidden,(char*)(name->data))) return 0;
+  int* n=(int*)get_from_map(mentions,(char*)(name->data));
+  return n && *n==1;
+}
+
+/*
+  Keeps only as many names to declare up front as there is room for in the main function
+  Names past the limit stay global, which only makes them slower to read and visible to other chunks
+  Returns how much room is left
+*/
+static int limit_hidden_definitions(int room){
+  for(int a=(room>0)?room:0;a<hidden->n;a++) put_in_map(hidden,hidden->data[a].k,NULL);
+  return (room>hidden->n)?room-hidden->n:0;
+}
+
+/*
+  Declares every hidden top-level definition and direct method that fits up front
+  Definitions then assign to the locals, so functions can use ones defined after them
+*/
+static void write_hidden_definitions(){
+  int n=0;
+  for(int a=0;a<hidden->n;a++){
+    char* name=(char*)iterate_from_map(hidden,a);
+    if(name) write(n++?",%s":"local %s",name);
+  }
+  if(n) write("\n");
+}
+
+/*
+  Declares the locals that hoisted globals are read through
+*/
+static void write_hoisted_globals(int room){
+  List* ls=hoist_globals(room);
+  for(int a=0;a<ls->n;a++){
+    Global* g=(Global*)get_from_list(ls,a);
+    if(g->hoisted) write("local %s=%s\n",g->alias,g->name);
+  }
+}
+
+/*
+  Returns 1 if an AST_FIELD node names a method of a class or interface instance
+  Only meaningful during the check step
+*/
+static int is_method_field(AstNode* node){
+  StringAstNode* data=(StringAstNode*)(node->data);
+  AstNode* type=get_type(data->node);
+  if(type->type!=AST_TYPE_BASIC) return 0;
+  Map* members=NULL;
+  InterfaceNode* inode=interface_exists((char*)(type->data));
+  ClassNode* cnode=class_exists((char*)(type->data));
+  if(inode) members=get_interface_members(inode);
+  if(cnode) members=get_class_members(cnode);
+  MemberNode* member=members?(MemberNode*)get_from_map(members,data->text):NULL;
+  return member && member->kind==AST_FUNCTION;
+}
+
+/*
+  Writes a function's parameter list, starting with the instance if with_instance is set
+  func may be NULL for a function without parameters
+*/
+static void write_parameters(FunctionNode* func,int with_instance){
+  write("(");
+  if(with_instance) write("%s",instance_str);
+  if(func && func->args){
+    for(int a=0;a<func->args->n;a++){
+      StringAstNode* e=(StringAstNode*)get_from_list(func->args,a);
+      if(a || with_instance) write(",");
+      write("%s",e->text);
+    }
+  }
+  write(")\n");
+}
+
+/*
+  Returns 1 if an expression only combines literals
+  Such expressions have no side effects and don't depend on the instance being built
+*/
+static int constant_expression(AstNode* node){
+  if(node->type==AST_PRIMITIVE) return strcmp(((StringAstNode*)(node->data))->text,"...")!=0;
+  if(node->type==AST_PAREN) return constant_expression((AstNode*)(node->data));
+  if(node->type==AST_UNARY) return constant_expression(((BinaryNode*)(node->data))->l);
+  if(node->type==AST_BINARY){
+    BinaryNode* data=(BinaryNode*)(node->data);
+    if(!strcmp(data->text,"as")) return constant_expression(data->l);
+    return constant_expression(data->l) && constant_expression(data->r);
+  }
+  if(node->type==AST_TABLE){
+    List* vals=((TableNode*)(node->data))->vals;
+    for(int a=0;a<vals->n;a++) if(!constant_expression((AstNode*)get_from_list(vals,a))) return 0;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if a class field can be initialized in the instance's table constructor
+  Its initializer must be constant, and so must the initializer of any ancestor field it overrides
+  Only called during the check step
+*/
+static int constant_field(ClassNode* data,BinaryNode* field){
+  if(!field->r || !constant_expression(field->r)) return 0;
+  for(ClassNode* p=class_exists(data->parent);p;p=class_exists(p->parent)){
+    for(int a=0;a<p->ls->n;a++){
+      AstNode* child=(AstNode*)get_from_list(p->ls,a);
+      if(child->type!=AST_DEFINE) continue;
+      BinaryNode* cdata=(BinaryNode*)(child->data);
+      if(strcmp(cdata->text,field->text)) continue;
+      if(!cdata->r || !constant_expression(cdata->r)) return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+  Writes a table constructor with every constant field from a class layout
+*/
+static void write_constant_fields(Map* fields){
+  int n=0;
+  write("{");
+  for(int a=0;fields && a<fields->n;a++){
+    AstNode* child=(AstNode*)iterate_from_map(fields,a);
+    if(child->type!=AST_DEFINE || child->resolution!=RS_CONSTANT) continue;
+    BinaryNode* cdata=(BinaryNode*)(child->data);
+    if(n++) write(",");
+    write("%s=",cdata->text);
+    process_node(cdata->r);
+  }
+  write("}");
+}
+
+/*
+  Returns the AST_FUNCTION node of the method a class has for some name, searching up its ancestors
+  Stores the class that declares the method in owner
+*/
+static AstNode* find_method(ClassNode* clas,char* name,ClassNode** owner){
+  for(;clas;clas=class_exists(clas->parent)){
+    for(int a=0;a<clas->ls->n;a++){
+      AstNode* child=(AstNode*)get_from_list(clas->ls,a);
+      if(child->type!=AST_FUNCTION) continue;
+      FunctionNode* func=(FunctionNode*)(child->data);
+      if(func->is_constructor || strcmp((char*)(func->name->data),name)) continue;
+      *owner=clas;
+      return child;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Returns the AST_FUNCTION node of the method an AST_FIELD node names if no subclass can override it
+  That is the case when the receiver's class or the method itself is final
+  Stores the class that declares the method in owner
+  Only called during the check step
+*/
+static AstNode* final_method(AstNode* node,ClassNode** owner){
+  StringAstNode* field=(StringAstNode*)(node->data);
+  AstNode* type=get_type(field->node);
+  ClassNode* clas=(type->type==AST_TYPE_BASIC)?class_exists((char*)(type->data)):NULL;
+  AstNode* method=clas?find_method(clas,field->text,owner):NULL;
+  if(!method || !(clas->is_final || ((FunctionNode*)(method->data))->is_final)) return NULL;
+  return method;
+}
+
+/*
+  Turns a method call into a call of the method's own function when no subclass can override it
+  Only called during the check step for method calls
+*/
+static void devirtualize(AstNode* call){
+  StringAstNode* field=(StringAstNode*)(((AstAstNode*)(call->data))->l->data);
+  ClassNode* owner=NULL;
+  AstNode* method=final_method(((AstAstNode*)(call->data))->l,&owner);
+  if(!method) return;
+  char* name=(char*)malloc(sizeof(char)*(strlen(owner->name)+strlen(field->text)+3));
+  sprintf(name,"%s__%s",owner->name,field->text);
+  if(moonshot_option(OPTION_METATABLE_CLASSES)) declare_upfront(name);
+  free(name);
+  method->resolution=RS_DIRECT;
+  call->resolution=RS_DIRECT;
+  call->ref=owner;
+}
+
+/*
+  Returns the position of a function's parameter with some name, or -1 if it has none
+*/
+static int parameter_index(FunctionNode* func,char* name){
+  for(int a=0;a<func->args->n;a++){
+    if(!strcmp(((StringAstNode*)get_from_list(func->args,a))->text,name)) return a;
+  }
+  return -1;
+}
+
+/*
+  Returns 1 if a returned expression can be written in place of a call within a budget of AST nodes
+  It can't call anything, so inlining never recurses, and it can only read parameters, the instance and constants
+  Only meaningful during the output step
+*/
+static int inlinable_expression(AstNode* node,FunctionNode* func,int method,int* budget){
+  if(--(*budget)<0) return 0;
+  if(fold_constant(node)) return 1;
+  if(node->type==AST_PRIMITIVE) return strcmp(((StringAstNode*)(node->data))->text,"...")!=0;
+  if(node->type==AST_PAREN) return inlinable_expression((AstNode*)(node->data),func,method,budget);
+  if(node->type==AST_UNARY) return inlinable_expression(((BinaryNode*)(node->data))->l,func,method,budget);
+  if(node->type==AST_BINARY){
+    BinaryNode* data=(BinaryNode*)(node->data);
+    if(!inlinable_expression(data->l,func,method,budget)) return 0;
+    return !strcmp(data->text,"as") || inlinable_expression(data->r,func,method,budget);
+  }
+  if(node->type==AST_FIELD){
+    return node->resolution==RS_NONE && inlinable_expression(((StringAstNode*)(node->data))->node,func,method,budget);
+  }
+  if(node->type==AST_ID){
+    if(node->resolution==RS_INSTANCE || node->resolution==RS_FIELD) return method;
+    return node->resolution==RS_NONE && parameter_index(func,(char*)(node->data))>=0;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if an argument or receiver can be written any number of times without changing what the call does
+*/
+static int trivial_value(AstNode* node){
+  if(node->type==AST_PRIMITIVE) return strcmp(((StringAstNode*)(node->data))->text,"...")!=0;
+  return node->type==AST_ID || fold_constant(node)!=NULL;
+}
+
+/*
+  Writes an argument or receiver of an inlined call where the inlined expression uses it
+  Values that aren't names or plain literals get parentheses, so they keep binding as a whole
+*/
+static void write_inline_value(AstNode* node){
+  FunctionNode* func=inlined;
+  char* text=fold_constant(node);
+  if(!text && node->type==AST_PRIMITIVE) text=((StringAstNode*)(node->data))->text;
+  int bare=text?isalnum((unsigned char)text[0]):1;
+  inlined=NULL;
+  if(!bare) write("(");
+  process_node(node);
+  if(!bare) write(")");
+  inlined=func;
+}
+
+/*
+  Returns 1 if a typed function is declared as a local of the chunk and nothing else is bound to its name
+  Global and exported functions can be replaced by other chunks, so calls to them are never inlined
+  Only meaningful during the output step
+*/
+static int owned_function(FunctionNode* func){
+  if(!func->is_typed || !func->name || func->name->type!=AST_ID) return 0;
+  char* name=(char*)(func->name->data);
+  int* n=(int*)get_from_map(bindings,name);
+  return get_from_map(hidden,name) && n && *n==1;
+}
+
+/*
+  Writes the expression returned by a small function or final method in place of a call to it
+  The callee's body must be a single return statement, and every argument must be trivial
+  Returns 0 without writing anything if the call can't be inlined
+*/
+static int inline_call(AstNode* node){
+  AstAstNode* data=(AstAstNode*)(node->data);
+  FunctionNode* func=NULL;
+  AstNode* receiver=NULL;
+  if(direct_call(node)){
+    ClassNode* owner=NULL;
+    StringAstNode* field=(StringAstNode*)(data->l->data);
+    AstNode* method=find_method((ClassNode*)(node->ref),field->text,&owner);
+    if(method) func=(FunctionNode*)(method->data);
+    receiver=field->node;
+    if(receiver->type!=AST_ID || fold_constant(receiver)) return 0;
+  }
+  if(node->resolution==RS_FUNCTION) func=(FunctionNode*)(node->ref);
+  if(node->resolution==RS_FUNCTION && !owned_function(func)) return 0;
+  if(!func || func->reassigned || !func->body || func->body->n!=1) return 0;
+  AstNode* ret=(AstNode*)get_from_list(func->body,0);
+  if(ret->type!=AST_RETURN || !ret->data) return 0;
+  List* returned=((AstListNode*)(((AstNode*)(ret->data))->data))->list;
+  List* args=data->r?((AstListNode*)(data->r->data))->list:NULL;
+  if(returned->n!=1 || (args?args->n:0)!=func->args->n) return 0;
+  for(int a=0;a<func->args->n;a++){
+    if(!strcmp(((StringAstNode*)get_from_list(func->args,a))->text,"...")) return 0;
+    if(!trivial_value((AstNode*)get_from_list(args,a))) return 0;
+  }
+  AstNode* expr=(AstNode*)get_from_list(returned,0);
+  int budget=MAX_INLINED_NODES;
+  if(!inlinable_expression(expr,func,receiver!=NULL,&budget)) return 0;
+  FunctionNode* outer=inlined;
+  AstNode* outer_receiver=inline_receiver;
+  List* outer_args=inline_args;
+  inlined=func;
+  inline_receiver=receiver;
+  inline_args=args;
+  if(expr->type!=AST_FIELD) write("(");
+  process_node(expr);
+  if(expr->type!=AST_FIELD) write(")");
+  inlined=outer;
+  inline_receiver=outer_receiver;
+  inline_args=outer_args;
+  return 1;
+}
+
+/*
+  Returns 1 if a class declares its constructor itself rather than inheriting it
+*/
+static int own_constructor(ClassNode* data,FunctionNode* constructor){
+  for(int a=0;a<data->ls->n;a++){
+    AstNode* child=(AstNode*)get_from_list(data->ls,a);
+    if(child->type==AST_FUNCTION && child->data==constructor) return 1;
+  }
+  return 0;
+}
+
+/*
+  Returns 1 if evaluating an expression can't have side effects or raise errors
+  Expressions that fold into constants qualify, while other operators might call metamethods
+*/
+static int side_effect_free(AstNode* node){
+  if(!node || node->type==AST_FUNCTION) return 1;
+  if(node->type==AST_PRIMITIVE) return strcmp(((StringAstNode*)(node->data))->text,"...")!=0;
+  if(node->type==AST_LIST) return side_effect_free((AstNode*)(node->data));
+  if(node->type==AST_TUPLE){
+    List* ls=((AstListNode*)(node->data))->list;
+    for(int a=0;a<ls->n;a++) if(!side_effect_free((AstNode*)get_from_list(ls,a))) return 0;
+    return 1;
+  }
+  if(node->type==AST_TABLE){
+    List* vals=((TableNode*)(node->data))->vals;
+    for(int a=0;a<vals->n;a++) if(!side_effect_free((AstNode*)get_from_list(vals,a))) return 0;
+    return 1;
+  }
+  return fold_constant(node)!=NULL;
+}
+
+/*
+  Returns 1 if a condition is always truthy, 0 if it is always falsy and -1 if it depends on runtime values
+  Only meaningful during the output step
+*/
+static int constant_condition(AstNode* node){
+  char* text=fold_constant(node);
+  if(node->type==AST_PRIMITIVE) text=((StringAstNode*)(node->data))->text;
+  if(!text || !strcmp(text,"...")) return -1;
+  return strcmp(text,"nil") && strcmp(text,"false");
+}
+
+/*
+  Writes a block of statements, leaving out the ones that can never run
+  Statements after a return, break or goto are unreachable until the next label
+*/
+static void write_statements(List* ls){
+  int reachable=1;
+  for(int a=0;a<ls->n;a++){
+    AstNode* e=(AstNode*)get_from_list(ls,a);
+    if(e->type==AST_LABEL) reachable=1;
+    if(!reachable){
+      eliminated[EL_STATEMENT]++;
+      continue;
+    }
+    if(unused_function(e)){
+      eliminated[EL_LOCAL]++;
+      continue;
+    }
+    int wrapped=0;
+    if(e->type==AST_RETURN){
+      // Lua only allows return at the end of a block, so one followed by a label gets its own block
+      for(int b=a+1;b<ls->n && !wrapped;b++) wrapped=((AstNode*)get_from_list(ls,b))->type==AST_LABEL;
+      if(wrapped){
+        write("do\n");
+        indent(1);
+      }
+    }
+    statement=e;
+    process_node(e);
+    conditional_newline(e);
+    if(wrapped){
+      indent(-1);
+      write("end\n");
+    }
+    if(e->type==AST_RETURN || e->type==AST_BREAK || e->type==AST_GOTO) reachable=0;
+  }
+}
+
+/*
+  Writes the rest of an if chain starting at an AST_IF, AST_ELSEIF or AST_ELSE node (or NULL)
+  Branches whose condition is constant are left out, and first is 1 while no branch has been written
+*/
+static void write_branches(AstNode* node,int first){
+  if(!node){
+    if(!first) write("end\n");
+    return;
+  }
+  if(node->type!=AST_ELSE){
+    IfNode* data=(IfNode*)(node->data);
+    int condition=constant_condition(data->expr);
+    if(!condition){
+      eliminated[EL_BRANCH]++;
+      write_branches(data->next,first);
+      return;
+    }
+    if(condition<0){
+      write(first?"if ":"elseif ");
+      process_node(data->expr);
+      write(" then\n");
+      indent(1);
+      process_node_list(data->body);
+      indent(-1);
+      write_branches(data->next,0);
+      return;
+    }
+
+    // Every branch after one that is always taken is unreachable
+    for(AstNode* e=data->next;e;e=(e->type==AST_ELSE)?NULL:((IfNode*)(e->data))->next) eliminated[EL_BRANCH]++;
+  }
+  write(first?"do\n":"else\n");
+  indent(1);
+  process_node_list((node->type==AST_ELSE)?(List*)(node->data):((IfNode*)(node->data))->body);
+  indent(-1);
+  write("end\n");
+}
+
 /*
   Canonical traversal method structure:
   if step==STEP_TYPEDEF
@@ -147,8 +792,100 @@ static void conditional_newline(AstNode* node){
     do your check and output steps
     pop scope
   end
+  Scopes are pushed and popped only in the check step
+  A method is only called for the steps it is registered for in the handler tables
 */
 
+/*
+  Traverses through a block of statements
+*/
+static void process_stmt(AstNode* node){
+  process_node_list((List*)(node->data));
+}
+
+/*
+  Handler tables for each traversal step, indexed by AstNode type
+  A NULL entry means that node type does no work during that step
+*/
+typedef void (*NodeHandler)(AstNode* node);
+static const NodeHandler typedef_handlers[NUM_RULES]={
+  [AST_INTERFACE]=process_interface,
+  [AST_TYPEDEF]=process_typedef,
+  [AST_REQUIRE]=process_require,
+  [AST_CLASS]=process_class
+};
+static const NodeHandler relate_handlers[NUM_RULES]={
+  [AST_INTERFACE]=process_interface,
+  [AST_TYPEDEF]=process_typedef,
+  [AST_REQUIRE]=process_require,
+  [AST_CLASS]=process_class
+};
+static const NodeHandler check_handlers[NUM_RULES]={
+  [AST_STMT]=process_stmt,
+  [AST_LIST]=process_list_primitive_node,
+  [AST_FUNCTION]=process_function,
+  [AST_REQUIRE]=process_require,
+  [AST_DEFINE]=process_define,
+  [AST_REPEAT]=process_repeat,
+  [AST_LTUPLE]=process_ltuple,
+  [AST_RETURN]=process_return,
+  [AST_BINARY]=process_binary,
+  [AST_FORNUM]=process_fornum,
+  [AST_ELSEIF]=process_elseif,
+  [AST_CLASS]=process_class,
+  [AST_SUPER]=process_super,
+  [AST_FORIN]=process_forin,
+  [AST_PAREN]=process_paren,
+  [AST_UNARY]=process_unary,
+  [AST_TUPLE]=process_tuple,
+  [AST_TABLE]=process_table,
+  [AST_LOCAL]=process_local,
+  [AST_WHILE]=process_while,
+  [AST_FIELD]=process_field,
+  [AST_CALL]=process_call,
+  [AST_ELSE]=process_else,
+  [AST_SET]=process_set,
+  [AST_SUB]=process_sub,
+  [AST_IF]=process_if,
+  [AST_DO]=process_do,
+  [AST_ID]=process_id
+};
+static const NodeHandler output_handlers[NUM_RULES]={
+  [AST_STMT]=process_stmt,
+  [AST_LIST]=process_list_primitive_node,
+  [AST_PRIMITIVE]=process_primitive,
+  [AST_FUNCTION]=process_function,
+  [AST_REQUIRE]=process_require,
+  [AST_DEFINE]=process_define,
+  [AST_REPEAT]=process_repeat,
+  [AST_LTUPLE]=process_ltuple,
+  [AST_RETURN]=process_return,
+  [AST_BINARY]=process_binary,
+  [AST_FORNUM]=process_fornum,
+  [AST_ELSEIF]=process_elseif,
+  [AST_CLASS]=process_class,
+  [AST_SUPER]=process_super,
+  [AST_BREAK]=process_break,
+  [AST_FORIN]=process_forin,
+  [AST_PAREN]=process_paren,
+  [AST_UNARY]=process_unary,
+  [AST_TUPLE]=process_tuple,
+  [AST_TABLE]=process_table,
+  [AST_LOCAL]=process_local,
+  [AST_WHILE]=process_while,
+  [AST_FIELD]=process_field,
+  [AST_LABEL]=process_label,
+  [AST_GOTO]=process_goto,
+  [AST_CALL]=process_call,
+  [AST_ELSE]=process_else,
+  [AST_SET]=process_set,
+  [AST_SUB]=process_sub,
+  [AST_IF]=process_if,
+  [AST_DO]=process_do,
+  [AST_ID]=process_id
+};
+static const NodeHandler* const handlers[]={typedef_handlers,relate_handlers,check_handlers,output_handlers};
+
 /*
   Process a list of AstNodes
   Usually called once for each scope
@@ -156,65 +893,52 @@ static void conditional_newline(AstNode* node){
 void process_node_list(List* ls){
   if(step==STEP_CHECK){
     // We need to load up scoped types before we can check this scope
+    // Declarations are collected in the same sweep so relating them doesn't revisit the whole list
+    Scope* scope=get_scope();
+    int first=scope->decls->n;
     step=STEP_TYPEDEF;
-    for(int a=0;a<ls->n;a++) process_node((AstNode*)get_from_list(ls,a));
+    for(int a=0;a<ls->n;a++){
+      AstNode* e=(AstNode*)get_from_list(ls,a);
+      if(!typedef_handlers[e->type]) continue;
+      add_to_list(scope->decls,e);
+      process_node(e);
+    }
 
     step=STEP_RELATE;
-    for(int a=0;a<ls->n;a++) process_node((AstNode*)get_from_list(ls,a));
+    for(int a=first;a<scope->decls->n;a++) process_node((AstNode*)get_from_list(scope->decls,a));
+    index_type_hierarchy();
+    index_entity_members(scope->decls);
 
     step=STEP_CHECK;
     for(int a=0;a<ls->n;a++) process_node((AstNode*)get_from_list(ls,a));
     quell_expired_scope_equivalences(get_num_scopes());
   }
-  if(step==STEP_OUTPUT){
-    for(int a=0;a<ls->n;a++){
-      AstNode* e=(AstNode*)get_from_list(ls,a);
-      process_node(e);
-      conditional_newline(e);
-    }
-  }
+  if(step==STEP_OUTPUT) write_statements(ls);
 }
 
 /*
-  Switch for calling a specific traversal method by AstNode type
+  Calls the current step's traversal method for an AstNode's type
+  Node types without a method in any step are not valid Moonshot ASTs
+  Nothing is processed once the configured error limit is reached
 */
 void process_node(AstNode* node){
-  switch(node->type){
-    case AST_STMT: process_node_list((List*)(node->data)); return;
-    case AST_LIST: process_list_primitive_node(node); return;
-    case AST_PRIMITIVE: process_primitive(node); return;
-    case AST_INTERFACE: process_interface(node); return;
-    case AST_FUNCTION: process_function(node); return;
-    case AST_TYPEDEF: process_typedef(node); return;
-    case AST_REQUIRE: process_require(node); return;
-    case AST_DEFINE: process_define(node); return;
-    case AST_REPEAT: process_repeat(node); return;
-    case AST_LTUPLE: process_ltuple(node); return;
-    case AST_RETURN: process_return(node); return;
-    case AST_BINARY: process_binary(node); return;
-    case AST_FORNUM: process_fornum(node); return;
-    case AST_ELSEIF: process_elseif(node); return;
-    case AST_CLASS: process_class(node); return;
-    case AST_SUPER: process_super(node); return;
-    case AST_BREAK: process_break(node); return;
-    case AST_FORIN: process_forin(node); return;
-    case AST_PAREN: process_paren(node); return;
-    case AST_UNARY: process_unary(node); return;
-    case AST_TUPLE: process_tuple(node); return;
-    case AST_TABLE: process_table(node); return;
-    case AST_LOCAL: process_local(node); return;
-    case AST_WHILE: process_while(node); return;
-    case AST_FIELD: process_field(node); return;
-    case AST_LABEL: process_label(node); return;
-    case AST_GOTO: process_goto(node); return;
-    case AST_CALL: process_call(node); return;
-    case AST_ELSE: process_else(node); return;
-    case AST_SET: process_set(node); return;
-    case AST_SUB: process_sub(node); return;
-    case AST_IF: process_if(node); return;
-    case AST_DO: process_do(node); return;
-    case AST_ID: process_id(node); return;
-    default: add_error(node->line,"invalid Moonshot AST detected (node ID %i)",node->type);
+  if(moonshot_error_limit_reached()) return;
+  if(step==STEP_OUTPUT){
+    char* text=fold_constant(node);
+    int wrapped=text && text[0]=='-' && (operand || node->type==AST_PAREN);
+    operand=0;
+    if(text){
+      // Parentheses around negative numbers keep them from binding to a following exponent
+      if(wrapped) write("(%s)",text);
+      else write("%s",text);
+      return;
+    }
+  }
+  NodeHandler handler=handlers[step][node->type];
+  if(handler){
+    handler(node);
+  }else if(!typedef_handlers[node->type] && !check_handlers[node->type] && !output_handlers[node->type]){
+    add_error(node->line,node->column,"invalid Moonshot AST detected (node ID %i)",node->type);
   }
 }
 
@@ -224,76 +948,116 @@ void process_node(AstNode* node){
 void process_interface(AstNode* node){
   InterfaceNode* data=(InterfaceNode*)(node->data);
   if(step==STEP_TYPEDEF){
-    ERROR(type_exists(data->name),node->line,"type %s is already declared",data->name);
+    ERROR(type_exists(data->name),node,"type %s is already declared",data->name);
     register_type(data->name);
     register_interface(data);
   }
   if(step==STEP_RELATE){
     if(data->parent){
-      ERROR(!interface_exists(data->parent),node->line,"parent interface %s does not exist",data->parent);
-      ERROR(!add_child_type(data->name,data->parent,RL_EXTENDS),node->line,"co-dependent interface %s detected",data->name);
+      ERROR(!interface_exists(data->parent),node,"parent interface %s does not exist",data->parent);
+      ERROR(!add_child_type(data->name,data->parent,RL_EXTENDS),node,"co-dependent interface %s detected",data->name);
     }
   }
 }
 void process_class(AstNode* node){
   ClassNode* data=(ClassNode*)(node->data);
   if(step==STEP_TYPEDEF){
-    ERROR(type_exists(data->name),node->line,"type %s is already declared",data->name);
+    ERROR(type_exists(data->name),node,"type %s is already declared",data->name);
     register_type(data->name);
     register_class(data);
   }else if(step==STEP_RELATE){
     if(data->parent){
-      ERROR(!class_exists(data->parent),node->line,"parent class %s does not exist",data->parent);
-      ERROR(!add_child_type(data->name,data->parent,RL_EXTENDS),node->line,"co-dependent class %s detected",data->name);
+      ERROR(!class_exists(data->parent),node,"parent class %s does not exist",data->parent);
+      ERROR(class_exists(data->parent)->is_final,node,"class %s cannot extend final class %s",data->name,data->parent);
+      ERROR(!add_child_type(data->name,data->parent,RL_EXTENDS),node,"co-dependent class %s detected",data->name);
     }
     for(int a=0;a<data->interfaces->n;a++){
       char* interface=(char*)get_from_list(data->interfaces,a);
-      ERROR(!interface_exists(interface),node->line,"interface %s does not exist",interface);
+      ERROR(!interface_exists(interface),node,"interface %s does not exist",interface);
       add_child_type(data->name,interface,RL_IMPLEMENTS);
     }
   }else{
-    push_class_scope(data);
+    if(step==STEP_CHECK){
+      hide_definition(node,data->name);
+      count_name(bindings,data->name);
+      if(moonshot_option(OPTION_METATABLE_CLASSES)){
+        char* table=(char*)malloc(sizeof(char)*(strlen(data->name)+8));
+        sprintf(table,"%s__class",data->name);
+        hide_definition(node,table);
+        free(table);
+      }
+      push_class_scope(data);
+    }
+    ClassLayout* layout=get_class_layout(data);
+    Map* fields=layout->fields;
     if(step==STEP_CHECK){
 
       // Check constructors
       int num_cons=num_constructors(data);
-      ERROR(num_cons>1,node->line,"class %s has %i constructors, should have only 1",data->name,num_cons);
+      ERROR(num_cons>1,node,"class %s has %i constructors, should have only 1",data->name,num_cons);
 
-      // Check unimplemented methods
-      List* missing=get_missing_class_methods(data);
-      if(missing->n){
-        for(int a=0;a<missing->n;a++){
-          FunctionNode* f=(FunctionNode*)get_from_list(missing,a);
-          add_error(node->line,"Class %s does not implement method %s",data->name,(char*)(f->name->data));
+      // Check overrides of final methods
+      for(int a=0;a<data->ls->n;a++){
+        AstNode* child=(AstNode*)get_from_list(data->ls,a);
+        if(child->type!=AST_FUNCTION || ((FunctionNode*)(child->data))->is_constructor) continue;
+        char* name=(char*)(((FunctionNode*)(child->data))->name->data);
+        ClassNode* owner;
+        AstNode* overridden=find_method(class_exists(data->parent),name,&owner);
+        if(overridden && ((FunctionNode*)(overridden->data))->is_final){
+          add_error(child->line,child->column,"method %s in class %s overrides final method of class %s",name,data->name,owner->name);
         }
       }
-      dealloc_list(missing);
-    }
-    List* all_fields=get_all_class_fields(data);
-    Map* fields=collapse_ancestor_class_fields(all_fields);
-    dealloc_list(all_fields);
-    ERROR(step==STEP_CHECK && !fields,node->line,"class %s has colliding names",data->name);
-    write("function %s(",data->name);
-    FunctionNode* fdata=get_constructor(data);
-    if(fdata){
-      for(int a=0;a<fdata->args->n;a++){
-        StringAstNode* e=(StringAstNode*)get_from_list(fdata->args,a);
-        if(a) write(",");
-        write("%s",e->text);
+
+      // Check unimplemented methods
+      for(int a=0;a<layout->missing->n;a++){
+        FunctionNode* f=(FunctionNode*)get_from_list(layout->missing,a);
+        add_error(node->line,node->column,"Class %s does not implement method %s",data->name,(char*)(f->name->data));
       }
     }
-    write(")\n");
-    indent(1);
-    write("local %s={}\n",instance_str);
+    ERROR(step==STEP_CHECK && !fields,node,"class %s has colliding names",data->name);
+    int metatable=moonshot_option(OPTION_METATABLE_CLASSES);
+    FunctionNode* fdata=layout->constructor;
+    if(step==STEP_CHECK){
+      node->ref=class_exists(data->parent);
+      mark_global_assigned(data->name);
+    }
+    ClassNode* parent=(ClassNode*)(node->ref);
+    ClassNode* outer_parent=parent_class;
+    parent_class=parent;
+    if(metatable){
+      if(parent) write("%s__class=setmetatable({},%s__class)\n",data->name,parent->name);
+      else write("%s__class={}\n",data->name);
+      write("%s__class.__index=%s__class\n",data->name,data->name);
+      write("function %s__class.__init(%s)\n",data->name,instance_str);
+      indent(1);
+      if(parent) write("%s__class.__init(%s)\n",parent->name,instance_str);
+    }else{
+      write("function %s",data->name);
+      write_parameters(fdata,0);
+      indent(1);
+      write("local %s=",instance_str);
+      write_constant_fields(fields);
+      write("\n");
+    }
     if(fields){
       for(int a=0;a<fields->n;a++){
         AstNode* child=(AstNode*)iterate_from_map(fields,a);
         if(child->type==AST_DEFINE){
           BinaryNode* cdata=(BinaryNode*)(child->data);
-          add_scoped_var(new_string_ast_node(cdata->text,cdata->l));
+          if(step==STEP_CHECK){
+            add_scoped_var(new_string_ast_node(cdata->text,cdata->l));
+            if(resolving && declared_by_class(data,child)) child->resolution=constant_field(data,cdata)?RS_CONSTANT:RS_NONE;
+          }else{
+            // Constant fields are set by the table constructor, and new tables have no fields to clear
+            if(child->resolution==RS_CONSTANT || (!metatable && !cdata->r)) continue;
+            if(metatable && !declared_by_class(data,child)) continue;
+          }
           if(cdata->r){
+            int declared=resolving;
+            resolving=declared && declared_by_class(data,child);
             write("%s.%s=",instance_str,cdata->text);
             process_node(cdata->r);
+            resolving=declared;
           }else{
             write("%s.%s=nil",instance_str,cdata->text);
           }
@@ -301,10 +1065,41 @@ void process_class(AstNode* node){
         }
       }
     }
-    if(fdata){
-      push_function_scope(fdata);
+    int own=fdata && own_constructor(data,fdata);
+    if(metatable){
+      indent(-1);
+      write("end\n");
+      if(own){
+        write("function %s__class.__new",data->name);
+        write_parameters(fdata,1);
+        indent(1);
+      }
+    }
+    if(fdata && (own || !metatable || step==STEP_CHECK)){
+      if(step==STEP_CHECK) push_function_scope(fdata);
       process_node_list(fdata->body);
-      pop_scope();
+      if(step==STEP_CHECK) pop_scope();
+    }
+    if(metatable){
+      if(own){
+        indent(-1);
+        write("end\n");
+      }
+      write("function %s",data->name);
+      write_parameters(fdata,0);
+      indent(1);
+      write("local %s=setmetatable(",instance_str);
+      write_constant_fields(fields);
+      write(",%s__class)\n",data->name);
+      write("%s__class.__init(%s)\n",data->name,instance_str);
+      if(fdata){
+        write("%s__class.__new(%s",data->name,instance_str);
+        for(int a=0;a<fdata->args->n;a++) write(",%s",((StringAstNode*)get_from_list(fdata->args,a))->text);
+        write(")\n");
+      }
+      write("return %s\n",instance_str);
+      indent(-1);
+      write("end\n");
     }
     if(fields){
       for(int a=0;a<fields->n;a++){
@@ -312,34 +1107,36 @@ void process_class(AstNode* node){
         if(child->type==AST_FUNCTION){
           fdata=(FunctionNode*)(child->data);
           if(fdata->is_constructor) continue;
-          push_function_scope(fdata);
+          if(metatable && step==STEP_OUTPUT && !declared_by_class(data,child)) continue;
+          if(step==STEP_CHECK) push_function_scope(fdata);
+          int declared=resolving;
+          resolving=declared && declared_by_class(data,child);
           char* funcname=(char*)(fdata->name->data);
           //add_scoped_var(new_string_ast_node(funcname,get_type(child)));
-          write("%s.%s=function(",instance_str,funcname);
-          if(fdata->args){
-            for(int a=0;a<fdata->args->n;a++){
-              if(a) write(",");
-              char* arg=((StringAstNode*)get_from_list(fdata->args,a))->text;
-              write("%s",arg);
-            }
-          }
-          write(")\n");
+          if(metatable && child->resolution==RS_DIRECT) write("function %s__%s",data->name,funcname);
+          else if(metatable) write("function %s__class.%s",data->name,funcname);
+          else write("%s.%s=function",instance_str,funcname);
+          write_parameters(fdata,metatable);
           indent(1);
           process_node_list(fdata->body);
           indent(-1);
           write("end\n");
-          pop_scope();
+          if(metatable && child->resolution==RS_DIRECT) write("%s__class.%s=%s__%s\n",data->name,funcname,data->name,funcname);
+          resolving=declared;
+          if(step==STEP_CHECK) pop_scope();
         }else if(child->type!=AST_DEFINE){
-          add_error(child->line,"invalid child node in class %s",data->name);
+          add_error(child->line,child->column,"invalid child node in class %s",data->name);
           break;
         }
       }
-      dealloc_map(fields);
     }
-    write("return %s\n",instance_str);
-    indent(-1);
-    write("end\n");
-    pop_scope();
+    if(!metatable){
+      write("return %s\n",instance_str);
+      indent(-1);
+      write("end\n");
+    }
+    parent_class=outer_parent;
+    if(step==STEP_CHECK) pop_scope();
   }
 }
 
@@ -347,15 +1144,13 @@ void process_class(AstNode* node){
   Traverses through node groups
 */
 void process_do(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    push_scope();
-    write("do\n");
-    indent(1);
-    process_node_list((List*)(node->data));
-    indent(-1);
-    write("end\n");
-    pop_scope();
-  }
+  enter_scope();
+  write("do\n");
+  indent(1);
+  process_node_list((List*)(node->data));
+  indent(-1);
+  write("end\n");
+  exit_scope();
 }
 
 /*
@@ -377,30 +1172,30 @@ static int validate_function_parameters(char* target,AstNode* func,AstNode* args
   if(args_node){
     List* args=((AstListNode*)(args_node->data))->list;
     if(!funcargs){
-      add_error(func->line,"too many arguments for %s",target);
+      add_error(func->line,func->column,"too many arguments for %s",target);
       return 0;
     }
     int max=funcargs->n;
     if(is_variadic_function(funcargs)){
       if(args->n<funcargs->n-1){
-        add_error(func->line,"not enough arguments for %s",target);
+        add_error(func->line,func->column,"not enough arguments for %s",target);
         return 0;
       }
       max=funcargs->n-1;
     }else if(args->n!=funcargs->n){
-      add_error(func->line,"invalid number of arguments for %s",target);
+      add_error(func->line,func->column,"invalid number of arguments for %s",target);
       return 0;
     }
     for(int a=0;a<max;a++){
       AstNode* type1=get_type((AstNode*)get_from_list(args,a));
       AstNode* type2=(AstNode*)get_from_list(funcargs,a);
       if(!typed_match(type2,type1)){
-        add_error(func->line,"invalid argument provided for %s",target);
+        add_error(func->line,func->column,"invalid argument provided for %s",target);
         return 0;
       }
     }
   }else if(funcargs && funcargs->n && !(funcargs->n==1 && is_variadic_function(funcargs))){
-    add_error(func->line,"not enough arguments for %s",target);
+    add_error(func->line,func->column,"not enough arguments for %s",target);
     return 0;
   }
   return 1;
@@ -411,103 +1206,131 @@ static int validate_function_parameters(char* target,AstNode* func,AstNode* args
 */
 void process_call(AstNode* node){
   AstAstNode* data=(AstAstNode*)(node->data);
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    if(step==STEP_CHECK){
-      char* name=NULL;
-      AstNode* functype=NULL;
-      AstNode* funcnode=NULL;
-      FunctionNode* func=NULL;
-      AstNode* dummy_constructor_type=NULL;
-      if(data->l->type==AST_ID){
-        name=(char*)(data->l->data);
-        func=function_exists(name);
-        if(func){
-          funcnode=new_node(AST_FUNCTION,-1,func);
-          functype=get_type(funcnode);
-        }else{
-          ClassNode* clas=class_exists(name);
-          if(clas){
-            FunctionNode* constructor=get_constructor(clas);
-            if(constructor){
-              funcnode=new_node(AST_FUNCTION,-1,constructor);
-              functype=get_type(funcnode);
-            }else{
-              dummy_constructor_type=new_node(AST_TYPE_FUNC,-1,new_ast_list_node(new_node(AST_TYPE_BASIC,-1,name),new_default_list()));
-              functype=dummy_constructor_type;
-            }
+  if(step==STEP_CHECK){
+    char* name=NULL;
+    AstNode* functype=NULL;
+    AstNode* funcnode=NULL;
+    FunctionNode* func=NULL;
+    if(data->l->type==AST_ID){
+      name=(char*)(data->l->data);
+      func=function_exists(name);
+      if(func){
+        funcnode=new_node(AST_FUNCTION,-1,-1,func);
+        functype=get_type(funcnode);
+      }else{
+        ClassNode* clas=class_exists(name);
+        if(clas){
+          FunctionNode* constructor=get_constructor(clas);
+          if(constructor){
+            funcnode=new_node(AST_FUNCTION,-1,-1,constructor);
+            functype=get_type(funcnode);
+          }else{
+            functype=new_function_type(new_basic_type(name),new_default_list());
           }
         }
-      }else if(data->l->type==AST_FIELD){
-        name=((StringAstNode*)(data->l->data))->text;
-        functype=get_type(data->l);
-      }
-      if(functype){
-        char* target=(char*)malloc(sizeof(char)*(strlen(name)+10));
-        sprintf(target,"function %s",name);
-        validate_function_parameters(target,funcnode,data->r);
-        if(dummy_constructor_type){
-          dealloc_ast_type(dummy_constructor_type);
-        }
-        if(funcnode) free(funcnode);
-        free(target);
       }
+    }else if(data->l->type==AST_FIELD){
+      name=((StringAstNode*)(data->l->data))->text;
+      functype=get_type(data->l);
+    }
+    if(functype){
+      char* target=(char*)malloc(sizeof(char)*(strlen(name)+10));
+      sprintf(target,"function %s",name);
+      validate_function_parameters(target,funcnode,data->r);
+      if(funcnode) free(funcnode);
+      free(target);
     }
     process_node(data->l);
-    write("(");
+    unfoldable_prefix(data->l);
+    if(resolving && data->l->type==AST_FIELD && is_method_field(data->l)) devirtualize(node);
+    if(resolving && func && !get_scoped_var(name)){
+      node->resolution=RS_FUNCTION;
+      node->ref=func;
+    }
     if(data->r) process_node(data->r);
-    write(")");
+    return;
+  }
+  if(moonshot_option(OPTION_INLINE_CALLS) && node!=statement && inline_call(node)) return;
+  if(direct_call(node) && moonshot_option(OPTION_METATABLE_CLASSES)){
+    StringAstNode* field=(StringAstNode*)(data->l->data);
+    write("%s__%s(",((ClassNode*)(node->ref))->name,field->text);
+    process_node(field->node);
+    if(data->r) write(",");
+  }else if(data->l->resolution==RS_METHOD){
+    StringAstNode* field=(StringAstNode*)(data->l->data);
+    process_node(field->node);
+    write(":%s(",field->text);
+  }else{
+    process_node(data->l);
+    write("(");
   }
+  if(data->r) process_node(data->r);
+  write(")");
 }
 void process_super(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstNode* data=(AstNode*)(node->data);
+  AstNode* data=(AstNode*)(node->data);
+  ClassNode* parent=NULL;
+  FunctionNode* method=(FunctionNode*)(node->ref);
+  int declared=resolving;
+  if(step==STEP_CHECK){
     ClassNode* clas=get_class_scope();
     FunctionNode* func=get_method_scope();
-    if(step==STEP_CHECK){
-      ERROR(!clas,node->line,"cannot use super methods outside of a class",NULL);
-      ERROR(!func,node->line,"must use super keyword within a class method",NULL);
-      ERROR(!clas->parent,node->line,"cannot use super methods because %s is not a child class",clas->name);
-    }
-    ClassNode* parent=class_exists(clas->parent);
-    FunctionNode* method=get_parent_method(parent,func);
-    if(step==STEP_CHECK){
-      if(!func->is_constructor){
-        assert(func->name->type==AST_ID); // I'm assuming func->name is of type AST_ID
-      }
-      ERROR(!method && func->is_constructor,node->line,"constructor in class %s does not override a super constructor",clas->name);
-      ERROR(!method && !func->is_constructor,node->line,"method %s in class %s does not override a super method",(char*)(func->name->data),clas->name);
-      char* target=(char*)malloc(sizeof(char)*(strlen(parent->name)+22));
-      sprintf(target,"constructor of class %s",parent->name);
-      AstNode* fnode=new_node(AST_FUNCTION,-1,method);
-      validate_function_parameters(target,fnode,data);
-      free(target);
-      free(fnode);
+    ERROR(!clas,node,"cannot use super methods outside of a class",NULL);
+    ERROR(!func,node,"must use super keyword within a class method",NULL);
+    ERROR(!clas->parent,node,"cannot use super methods because %s is not a child class",clas->name);
+    parent=class_exists(clas->parent);
+    method=get_parent_method(parent,func);
+    if(!func->is_constructor){
+      assert(func->name->type==AST_ID); // I'm assuming func->name is of type AST_ID
     }
+    ERROR(!method && func->is_constructor,node,"constructor in class %s does not override a super constructor",clas->name);
+    ERROR(!method && !func->is_constructor,node,"method %s in class %s does not override a super method",(char*)(func->name->data),clas->name);
+    char* target=(char*)malloc(sizeof(char)*(strlen(parent->name)+22));
+    sprintf(target,"constructor of class %s",parent->name);
+    AstNode* fnode=new_node(AST_FUNCTION,-1,-1,method);
+    validate_function_parameters(target,fnode,data);
+    free(target);
+    free(fnode);
+    if(resolving) node->ref=method;
     push_class_scope(parent);
     push_function_scope(method);
-    write("(function(");
-    for(int a=0;a<method->args->n;a++){
-      StringAstNode* e=(StringAstNode*)get_from_list(method->args,a);
-      if(a) write(",");
-      write("%s",e->text);
-    }
-    write(")\n");
-    indent(1);
-    for(int a=0;a<method->body->n;a++){
-      AstNode* child=(AstNode*)get_from_list(method->body,a);
-      process_node(child);
-      conditional_newline(child);
-    }
-    indent(-1);
-    write("end)(");
+    resolving=0;
+  }
+  if(step==STEP_OUTPUT && moonshot_option(OPTION_METATABLE_CLASSES)){
+    // Metatable classes call the parent's method directly
+    write("%s__class.%s(%s",parent_class->name,method->is_constructor?"__new":(char*)(method->name->data),instance_str);
     if(data){
       List* args=((AstListNode*)(data->data))->list;
       for(int a=0;a<args->n;a++){
-        if(a) write(",");
+        write(",");
         process_node((AstNode*)get_from_list(args,a));
       }
     }
-    write(")\n");
+    write(")");
+    return;
+  }
+  write("(function(");
+  for(int a=0;a<method->args->n;a++){
+    StringAstNode* e=(StringAstNode*)get_from_list(method->args,a);
+    if(a) write(",");
+    write("%s",e->text);
+  }
+  write(")\n");
+  indent(1);
+  if(step==STEP_OUTPUT) write_statements(method->body);
+  for(int a=0;step==STEP_CHECK && a<method->body->n;a++) process_node((AstNode*)get_from_list(method->body,a));
+  indent(-1);
+  write("end)(");
+  if(step==STEP_CHECK) resolving=declared;
+  if(data){
+    List* args=((AstListNode*)(data->data))->list;
+    for(int a=0;a<args->n;a++){
+      if(a) write(",");
+      process_node((AstNode*)get_from_list(args,a));
+    }
+  }
+  write(")\n");
+  if(step==STEP_CHECK){
     pop_scope();
     pop_scope();
   }
@@ -518,86 +1341,141 @@ void process_super(AstNode* node){
 */
 void process_set(AstNode* node){
   AstAstNode* data=(AstAstNode*)(node->data);
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    if(step==STEP_CHECK){
-      AstNode* tl=get_type(data->l);
-      AstNode* tr=get_type(data->r);
-      if(tr->type==AST_TYPE_TUPLE){
-        List* ls=(List*)(tr->data);
-        if(ls->n==1) tr=(AstNode*)get_from_list(ls,0);
+  if(step==STEP_CHECK){
+    AstNode* tl=get_type(data->l);
+    AstNode* tr=get_type(data->r);
+    if(tr->type==AST_TYPE_TUPLE){
+      List* ls=(List*)(tr->data);
+      if(ls->n==1) tr=(AstNode*)get_from_list(ls,0);
+    }
+    ERROR(!typed_match(tl,tr),node,"expression of type %t cannot be assigned to variable of type %t",tr,tl);
+  }
+  process_node(data->l);
+  if(step==STEP_CHECK){
+    List* targets=(data->l->type==AST_LTUPLE)?((AstListNode*)(data->l->data))->list:NULL;
+    for(int a=0;a<(targets?targets->n:1);a++){
+      AstNode* target=targets?(AstNode*)get_from_list(targets,a):data->l;
+      ClassNode* owner=NULL;
+      AstNode* method=(target->type==AST_FIELD && is_method_field(target))?final_method(target,&owner):NULL;
+      ERROR(method,node,"cannot assign to final method %s of class %s",((StringAstNode*)(target->data))->text,owner->name);
+    }
+    assigns_global(data->l);
+    assigns_method(data->l);
+    assigns_field(data->l);
+    reassigns_function(data->l);
+    if(data->l->type==AST_ID) mark_reassigned(data->l);
+    if(data->l->type==AST_LTUPLE){
+      List* ls=((AstListNode*)(data->l->data))->list;
+      for(int a=0;a<ls->n;a++){
+        AstNode* e=(AstNode*)get_from_list(ls,a);
+        if(e->type==AST_ID) mark_reassigned(e);
       }
-      ERROR(!typed_match(tl,tr),node->line,"expression of type %t cannot be assigned to variable of type %t",tr,tl);
     }
-    process_node(data->l);
-    write("=");
-    process_node(data->r);
-    write("\n");
   }
+  write("=");
+  if(step==STEP_OUTPUT && data->r->type==AST_TUPLE) write_set_values(data->l,data->r);
+  else process_node(data->r);
+  write("\n");
 }
 void process_return(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    if(step==STEP_CHECK){
-      FunctionNode* func=get_function_scope();
-      if(func){
-        AstNode* type1=func->type;
-        AstNode* type2=node->data?get_type(node->data):any_type_const();
-        if(type2->type==AST_TYPE_TUPLE){
-          List* ls=(List*)(type2->data);
-          if(ls->n==1){
-            type2=(AstNode*)get_from_list(ls,0);
-          }
+  if(step==STEP_CHECK){
+    FunctionNode* func=get_function_scope();
+    if(func){
+      AstNode* type1=func->type;
+      AstNode* type2=node->data?get_type(node->data):any_type_const();
+      if(type2->type==AST_TYPE_TUPLE){
+        List* ls=(List*)(type2->data);
+        if(ls->n==1){
+          type2=(AstNode*)get_from_list(ls,0);
         }
-        ERROR(!typed_match(type1,type2),node->line,"function of type %t cannot return type %t",type1,type2);
       }
+      ERROR(!typed_match(type1,type2),node,"function of type %t cannot return type %t",type1,type2);
     }
-    write("return");
-    if(node->data){
-      write(" ");
-      process_node((AstNode*)(node->data));
-    }
-    write("\n");
   }
+  write("return");
+  if(node->data){
+    write(" ");
+    process_node((AstNode*)(node->data));
+  }
+  write("\n");
 }
 
 /*
   Traverses through identifier nodes
 */
 void process_ltuple(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstListNode* data=(AstListNode*)(node->data);
-    for(int a=0;a<data->list->n;a++){
-      if(a) write(",");
-      process_id((AstNode*)get_from_list(data->list,a));
-    }
+  AstListNode* data=(AstListNode*)(node->data);
+  for(int a=0;a<data->list->n;a++){
+    if(a) write(",");
+    process_node((AstNode*)get_from_list(data->list,a));
   }
 }
 void process_field(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    StringAstNode* data=(StringAstNode*)(node->data);
+  StringAstNode* data=(StringAstNode*)(node->data);
+  if(step==STEP_CHECK){
     process_node(data->node);
-    write(".%s",data->text);
+    unfoldable_prefix(data->node);
+    if(resolving && moonshot_option(OPTION_METATABLE_CLASSES)){
+      node->resolution=is_method_field(node)?RS_METHOD:RS_NONE;
+    }
+    if(resolving && data->node->resolution==RS_GLOBAL){
+      node->ref=read_global_field((Global*)(data->node->ref),data->text);
+      if(node->ref) node->resolution=RS_GLOBAL;
+    }
+    return;
+  }
+  if(node->resolution==RS_GLOBAL && ((Global*)(node->ref))->hoisted){
+    write("%s",((Global*)(node->ref))->alias);
+    return;
   }
+  if(node->resolution==RS_METHOD){
+    // Methods used as values are bound to their instance
+    write("(function(o) return function(...) return o:%s(...) end end)(",data->text);
+    process_node(data->node);
+    write(")");
+    return;
+  }
+  process_node(data->node);
+  write(".%s",data->text);
 }
 void process_sub(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstAstNode* data=(AstAstNode*)(node->data);
-    process_node(data->l);
-    write("[");
-    process_node(data->r);
-    write("]");
-  }
+  AstAstNode* data=(AstAstNode*)(node->data);
+  process_node(data->l);
+  unfoldable_prefix(data->l);
+  write("[");
+  process_node(data->r);
+  write("]");
 }
 void process_id(AstNode* node){
-  if(step==STEP_OUTPUT){
-    char* var=(char*)(node->data);
-    if(get_class_scope() && !strcmp(var,"this")){
-      write("%s",instance_str);
-    }else{
-      if(field_defined_in_class(var)){
-        write("%s.",instance_str);
-      }
-      write("%s",var);
+  char* var=(char*)(node->data);
+  if(step==STEP_CHECK){
+    count_name(mentions,var);
+    reserve_name(var);
+    if(!resolving) return;
+    if(get_class_scope() && !strcmp(var,"this")) node->resolution=RS_INSTANCE;
+    else if(field_defined_in_class(var)) node->resolution=RS_FIELD;
+    else node->resolution=RS_NONE;
+    if(node->resolution==RS_NONE && moonshot_option(OPTION_HOIST_GLOBALS) && !get_scoped_var(var)){
+      node->ref=read_global(var);
+      if(node->ref) node->resolution=RS_GLOBAL;
     }
+    if(node->resolution==RS_NONE) resolve_constant_read(node);
+    return;
+  }
+  if(inlined){
+    int a=parameter_index(inlined,var);
+    if(node->resolution==RS_INSTANCE || node->resolution==RS_FIELD) write_inline_value(inline_receiver);
+    if(node->resolution==RS_FIELD) write(".%s",var);
+    if(node->resolution==RS_NONE && a>=0) write_inline_value((AstNode*)get_from_list(inline_args,a));
+    if(node->resolution!=RS_NONE || a>=0) return;
+  }
+  if(node->resolution==RS_INSTANCE){
+    write("%s",instance_str);
+  }else{
+    if(node->resolution==RS_FIELD){
+      write("%s.",instance_str);
+    }
+    write("%s",var);
   }
 }
 
@@ -613,46 +1491,59 @@ void process_require(AstNode* node){
   }
 }
 void process_local(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    StringAstNode* data=(StringAstNode*)(node->data);
-    write("local %s",data->text);
-    if(data->node){
-      write("=");
-      process_node(data->node);
-    }
-    write("\n");
+  StringAstNode* data=(StringAstNode*)(node->data);
+  if(step==STEP_CHECK){
+    mark_global_assigned(data->text);
+    declares_chunk_locals(1);
   }
+  write("local %s",data->text);
+  if(data->node){
+    write("=");
+    process_node(data->node);
+  }
+  write("\n");
 }
 void process_define(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    BinaryNode* data=(BinaryNode*)(node->data);
-    if(step==STEP_CHECK){
-      ERROR(!compound_type_exists(data->l),node->line,"reference to nonexistent type %t",data->l);
-      if(data->r){
-        AstNode* tr=get_type(data->r);
-        ERROR(!typed_match(data->l,tr),node->line,"expression of type %t cannot be assigned to variable of type %t",tr,data->l);
-      }
-      StringAstNode* data1=new_string_ast_node(data->text,data->l);
-      if(!add_scoped_var(data1)){
-        add_error(node->line,"variable %s was already declared in this scope",data->text);
-        free(data1);
-      }
+  BinaryNode* data=(BinaryNode*)(node->data);
+  if(step==STEP_CHECK){
+    ERROR(!compound_type_exists(data->l),node,"reference to nonexistent type %t",data->l);
+    if(data->r){
+      AstNode* tr=get_type(data->r);
+      ERROR(!typed_match(data->l,tr),node,"expression of type %t cannot be assigned to variable of type %t",tr,data->l);
+
+      // The variable isn't in scope within its own initializer
+      process_node(data->r);
     }
-    if(get_num_scopes()>1) write("local ");
-    write("%s=",data->text);
-    if(data->r) process_node(data->r);
-    else write("nil");
-    write("\n");
+    StringAstNode* data1=new_string_ast_node(data->text,data->l);
+    if(!add_scoped_var(data1)){
+      add_error(node->line,node->column,"variable %s was already declared in this scope",data->text);
+      free(data1);
+    }
+    node->resolution=(get_num_scopes()>1)?RS_LOCAL:RS_NONE;
+    if(node->resolution==RS_LOCAL) declares_chunk_locals(1);
+    if(node->resolution==RS_LOCAL && resolving) register_constant_candidate(node);
+    mark_global_assigned(data->text);
+    hide_definition(node,data->text);
+    if(node->resolution==RS_NONE) count_name(bindings,data->text);
+  }
+  if(step==STEP_OUTPUT && node->resolution==RS_LOCAL && unread_local(node) && side_effect_free(data->r)){
+    eliminated[EL_LOCAL]++;
+    return;
   }
+  if(node->resolution==RS_LOCAL) write("local ");
+  write("%s=",data->text);
+  if(data->r && step==STEP_OUTPUT) process_node(data->r);
+  if(!data->r) write("nil");
+  write("\n");
 }
 void process_typedef(AstNode* node){
   StringAstNode* data=(StringAstNode*)(node->data);
   if(step==STEP_TYPEDEF){
-    ERROR(type_exists(data->text),node->line,"type %s is already declared",data->text);
+    ERROR(type_exists(data->text),node,"type %s is already declared",data->text);
     register_type(data->text);
   }else if(step==STEP_RELATE){
-    ERROR(!compound_type_exists(data->node),node->line,"type %t does not exist",data->node);
-    ERROR(!add_type_equivalence(data->text,data->node,RL_EQUALS),node->line,"co-dependent typedef %s detected",data->text);
+    ERROR(!compound_type_exists(data->node),node,"type %t does not exist",data->node);
+    ERROR(!add_type_equivalence(data->text,data->node,RL_EQUALS),node,"co-dependent typedef %s detected",data->text);
   }
 }
 
@@ -660,41 +1551,53 @@ void process_typedef(AstNode* node){
   Traverses through a function node
 */
 void process_function(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    FunctionNode* data=(FunctionNode*)(node->data);
-    write("function");
-    if(data->name){
-      if(data->type) register_function(data);
-      write(" ");
-      process_node(data->name);
+  FunctionNode* data=(FunctionNode*)(node->data);
+  write("function");
+  if(data->name){
+    if(data->type && step==STEP_CHECK){
+      // A function defined again under the same name could be either one at runtime
+      FunctionNode* previous=(data->name->type==AST_ID)?function_exists((char*)(data->name->data)):NULL;
+      if(previous && previous!=data) previous->reassigned=data->reassigned=1;
+      register_function(data);
     }
-    write("(");
-    for(int a=0;a<data->args->n;a++){
-      if(a) write(",");
-      StringAstNode* e=(StringAstNode*)get_from_list(data->args,a);
-      ERROR(!compound_type_exists(e->node),node->line,"reference to nonexistent type %t",e->node);
-      write("%s",e->text);
+    write(" ");
+    process_node(data->name);
+    if(step==STEP_CHECK){
+      unfoldable_prefix(data->name);
+      assigns_global(data->name);
+      if(data->name->type==AST_ID) mark_reassigned(data->name);
+      assigns_field(data->name);
+      if(data->name->type==AST_ID) hide_definition(node,(char*)(data->name->data));
+      if(data->name->type==AST_ID) count_name(bindings,(char*)(data->name->data));
     }
-    write(")\n");
-    indent(1);
-    if(data->body){
-      push_function_scope(data);
-      int num_returns=0;
-      for(int a=0;a<data->body->n;a++){
-        AstNode* child=(AstNode*)get_from_list(data->body,a);
-        if(child->type==AST_RETURN) num_returns++;
-        process_node(child);
-        conditional_newline(child);
-      }
-      if(data->is_constructor){
-        ERROR(num_returns,node->line,"constructors cannot have return statements",NULL);
-      }else if(!is_primitive(data->type,PRIMITIVE_NIL) && data->type->type!=AST_TYPE_ANY){
-        ERROR(!num_returns,node->line,"function of type %t cannot return nil",data->type);
-      }
-      indent(-1);
-      write("end");
-      pop_scope();
+  }
+  write("(");
+  for(int a=0;a<data->args->n;a++){
+    if(a) write(",");
+    StringAstNode* e=(StringAstNode*)get_from_list(data->args,a);
+    ERROR(step==STEP_CHECK && !compound_type_exists(e->node),node,"reference to nonexistent type %t",e->node);
+    if(step==STEP_CHECK) reserve_name(e->text);
+    write("%s",e->text);
+  }
+  write(")\n");
+  indent(1);
+  if(data->body){
+    if(step==STEP_CHECK) push_function_scope(data);
+    if(step==STEP_OUTPUT) write_statements(data->body);
+    int num_returns=0;
+    for(int a=0;step==STEP_CHECK && a<data->body->n;a++){
+      AstNode* child=(AstNode*)get_from_list(data->body,a);
+      if(child->type==AST_RETURN) num_returns++;
+      process_node(child);
     }
+    if(step==STEP_CHECK && data->is_constructor){
+      ERROR(num_returns,node,"constructors cannot have return statements",NULL);
+    }else if(step==STEP_CHECK && !is_primitive(data->type,PRIMITIVE_NIL) && data->type->type!=AST_TYPE_ANY){
+      ERROR(!num_returns,node,"function of type %t cannot return nil",data->type);
+    }
+    indent(-1);
+    write("end");
+    if(step==STEP_CHECK) pop_scope();
   }
 }
 
@@ -702,174 +1605,164 @@ void process_function(AstNode* node){
   Traverses through conditional nodes
 */
 void process_repeat(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstListNode* data=(AstListNode*)(node->data);
-    write("repeat\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->list);
-    pop_scope();
-    indent(-1);
-    write("until ");
-    process_node(data->node);
-    write("\n");
-  }
+  AstListNode* data=(AstListNode*)(node->data);
+  write("repeat\n");
+  indent(1);
+  enter_scope();
+  process_node_list(data->list);
+  exit_scope();
+  indent(-1);
+  write("until ");
+  process_node(data->node);
+  write("\n");
 }
 void process_while(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstListNode* data=(AstListNode*)(node->data);
-    write("while ");
-    process_node(data->node);
-    write(" do\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->list);
-    pop_scope();
-    indent(-1);
-    write("end\n");
+  AstListNode* data=(AstListNode*)(node->data);
+  if(step==STEP_OUTPUT && !constant_condition(data->node)){
+    eliminated[EL_BRANCH]++;
+    return;
   }
+  write("while ");
+  process_node(data->node);
+  write(" do\n");
+  indent(1);
+  enter_scope();
+  process_node_list(data->list);
+  exit_scope();
+  indent(-1);
+  write("end\n");
 }
 void process_if(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    IfNode* data=(IfNode*)(node->data);
-    write("if ");
-    process_node(data->expr);
-    write(" then\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->body);
-    pop_scope();
-    indent(-1);
-    if(data->next) process_node(data->next);
-    else write("end\n");
+  IfNode* data=(IfNode*)(node->data);
+  if(step==STEP_OUTPUT){
+    write_branches(node,1);
+    return;
   }
+  write("if ");
+  process_node(data->expr);
+  write(" then\n");
+  indent(1);
+  enter_scope();
+  process_node_list(data->body);
+  exit_scope();
+  indent(-1);
+  if(data->next) process_node(data->next);
+  else write("end\n");
 }
 void process_elseif(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    IfNode* data=(IfNode*)(node->data);
-    write("elseif ");
-    process_node(data->expr);
-    write(" then\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->body);
-    pop_scope();
-    indent(-1);
-    if(data->next) process_node(data->next);
-    else write("end\n");
-  }
+  IfNode* data=(IfNode*)(node->data);
+  write("elseif ");
+  process_node(data->expr);
+  write(" then\n");
+  indent(1);
+  enter_scope();
+  process_node_list(data->body);
+  exit_scope();
+  indent(-1);
+  if(data->next) process_node(data->next);
+  else write("end\n");
 }
 void process_else(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    write("else\n");
-    indent(1);
-    push_scope();
-    process_node_list((List*)(node->data));
-    pop_scope();
-    indent(-1);
-    write("end\n");
-  }
+  write("else\n");
+  indent(1);
+  enter_scope();
+  process_node_list((List*)(node->data));
+  exit_scope();
+  indent(-1);
+  write("end\n");
 }
 
 /*
   Traverses through for loop nodes
 */
 void process_fornum(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    FornumNode* data=(FornumNode*)(node->data);
-    write("for %s=",data->name);
-    process_node(data->num1);
+  FornumNode* data=(FornumNode*)(node->data);
+  if(step==STEP_CHECK){
+    // Lua keeps the start, limit and step in hidden locals next to the loop variable
+    mark_global_assigned(data->name);
+    declares_chunk_locals(4);
+  }
+  write("for %s=",data->name);
+  process_node(data->num1);
+  write(",");
+  process_node(data->num2);
+  if(data->num3){
     write(",");
-    process_node(data->num2);
-    if(data->num3){
-      write(",");
-      process_node(data->num3);
-    }
-    push_scope();
-    write(" do\n");
-    indent(1);
-    process_node_list(data->body);
-    indent(-1);
-    write("end\n");
-    pop_scope();
+    process_node(data->num3);
   }
+  enter_scope();
+  write(" do\n");
+  indent(1);
+  process_node_list(data->body);
+  indent(-1);
+  write("end\n");
+  exit_scope();
 }
 void process_forin(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    ForinNode* data=(ForinNode*)(node->data);
-    write("for ");
-    process_node(data->lhs);
-    write(" in ");
-    process_node(data->tuple);
-    write(" do\n");
-    indent(1);
-    push_scope();
-    process_node_list(data->body);
-    indent(-1);
-    write("end\n");
-    pop_scope();
+  ForinNode* data=(ForinNode*)(node->data);
+  write("for ");
+  process_node(data->lhs);
+  if(step==STEP_CHECK){
+    // Lua keeps the iterator function, state and control variable in hidden locals
+    assigns_global(data->lhs);
+    declares_chunk_locals(3+((data->lhs->type==AST_LTUPLE)?((AstListNode*)(data->lhs->data))->list->n:1));
   }
+  write(" in ");
+  process_node(data->tuple);
+  write(" do\n");
+  indent(1);
+  enter_scope();
+  process_node_list(data->body);
+  indent(-1);
+  write("end\n");
+  exit_scope();
 }
 
 /*
   Traverses through simple control statement nodes
 */
 void process_break(AstNode* node){
-  if(step==STEP_OUTPUT){
-    write("break\n");
-  }
+  write("break\n");
 }
 void process_label(AstNode* node){
-  if(step==STEP_OUTPUT){
-    write("::%s::\n",(char*)(node->data));
-  }
+  write("::%s::\n",(char*)(node->data));
 }
 void process_goto(AstNode* node){
-  if(step==STEP_OUTPUT){
-    write("goto %s\n",(char*)(node->data));
-  }
+  write("goto %s\n",(char*)(node->data));
 }
 
 /*
   Traverses through table and list nodes
 */
 void process_table(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    TableNode* data=(TableNode*)(node->data);
-    write("{");
-    for(int a=0;a<data->keys->n;a++){
-      if(a) write(",");
-      write("%s=",(char*)get_from_list(data->keys,a));
-      process_node((AstNode*)get_from_list(data->vals,a));
-    }
-    write("}");
+  TableNode* data=(TableNode*)(node->data);
+  write("{");
+  for(int a=0;a<data->keys->n;a++){
+    if(a) write(",");
+    write("%s=",(char*)get_from_list(data->keys,a));
+    process_node((AstNode*)get_from_list(data->vals,a));
   }
+  write("}");
 }
 void process_list_primitive_node(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstNode* data=(AstNode*)(node->data);
-    write("{");
-    if(data) process_tuple(data);
-    write("}");
-  }
+  AstNode* data=(AstNode*)(node->data);
+  write("{");
+  if(data) process_node(data);
+  write("}");
 }
 
 /*
   Traverses through primitive value nodes
 */
 void process_primitive(AstNode* node){
-  if(step==STEP_OUTPUT){
-    write("%s",((StringAstNode*)(node->data))->text);
-  }
+  write("%s",((StringAstNode*)(node->data))->text);
 }
 void process_tuple(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    AstListNode* data=(AstListNode*)(node->data);
-    List* ls=data->list;
-    for(int a=0;a<ls->n;a++){
-      if(a) write(",");
-      process_node((AstNode*)get_from_list(ls,a));
-    }
+  AstListNode* data=(AstListNode*)(node->data);
+  List* ls=data->list;
+  for(int a=0;a<ls->n;a++){
+    if(a) write(",");
+    process_node((AstNode*)get_from_list(ls,a));
   }
 }
 
@@ -877,26 +1770,23 @@ void process_tuple(AstNode* node){
   Traverses through expression nodes
 */
 void process_unary(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    BinaryNode* data=(BinaryNode*)(node->data);
-    if(strcmp(data->text,"trust")) write("%s ",data->text);
-    process_node(data->l);
-  }
+  BinaryNode* data=(BinaryNode*)(node->data);
+  if(strcmp(data->text,"trust")) write("%s ",data->text);
+  operand=1;
+  process_node(data->l);
 }
 void process_binary(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    BinaryNode* data=(BinaryNode*)(node->data);
-    process_node(data->l);
-    if(strcmp(data->text,"as")){
-      write(" %s ",data->text);
-      process_node(data->r);
-    }
+  BinaryNode* data=(BinaryNode*)(node->data);
+  operand=1;
+  process_node(data->l);
+  if(strcmp(data->text,"as")){
+    write(" %s ",data->text);
+    operand=1;
+    process_node(data->r);
   }
 }
 void process_paren(AstNode* node){
-  if(step==STEP_CHECK || step==STEP_OUTPUT){
-    write("(");
-    process_node((AstNode*)(node->data));
-    write(")");
-  }
+  write("(");
+  process_node((AstNode*)(node->data));
+  write(")");
 }
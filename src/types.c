@@ -2,52 +2,86 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-static List* types_graph; // List of EqualTypesNodes
+static Map* types_graph; // Map of type names to Lists of outgoing EqualTypesNodes
+static List* types_edges; // Stack of every EqualTypesNode in the order they were added, grouped by scope
+static Map* reachable; // Map of type names to Maps of memoized path_exists results
+static int graph_generation; // Incremented whenever an edge is added to or removed from the graph
+static int reachable_generation; // The graph generation that the reachable cache was built for
+static Map* hierarchy; // Map of entity type names to HierarchyNodes
+static int hierarchy_generation; // The graph generation that the hierarchy index was built for
+static Map* matches; // Map of "l,r" type pointer pairs to memoized typed_match results
+static int matches_generation; // The graph generation that the matches cache was built for
+static int match_hits; // Number of typed_match calls answered by the matches cache
+static int match_misses; // Number of typed_match calls that had to be computed
+static int types_epoch; // Incremented whenever the result of get_type could change
 
 /*
   Initialize the data structures used in this module
 */
 void init_types(){
-  types_graph=new_default_list();
+  types_graph=new_default_map();
+  types_edges=new_default_list();
+  reachable=new_default_map();
+  hierarchy=new_default_map();
+  matches=new_default_map();
+  matches_generation=0;
+  types_epoch=0;
+  match_hits=0;
+  match_misses=0;
+  reachable_generation=0;
+  hierarchy_generation=-1;
+  graph_generation=0;
 }
 
 /*
-  Deallocate registers and equivalence graphs
+  Empties the memoized reachability cache
 */
-void dealloc_types(){
-  // Quelling scoped type equivalences means there shouldn't be
-  // any equivalences left by the time we get here
-  assert(types_graph->n==0);
-  dealloc_list(types_graph);
+static void clear_reachable(){
+  for(int a=0;a<reachable->n;a++) dealloc_map((Map*)iterate_from_map(reachable,a));
+  dealloc_map(reachable);
+  reachable=new_default_map();
 }
 
 /*
-  Deep copies a type to prevent deallocation errors
+  Empties the memoized typed_match cache
 */
-static AstNode* copy_type(AstNode* node){
-  switch(node->type){
-    case AST_TYPE_ANY: return new_node(AST_TYPE_ANY,-1,NULL);
-    case AST_TYPE_VARARG: return new_node(AST_TYPE_VARARG,-1,NULL);
-    case AST_TYPE_BASIC: return new_node(AST_TYPE_BASIC,-1,node->data);
-    case AST_TYPE_TUPLE:{
-      List* data=(List*)(node->data);
-      List* ls=new_default_list();
-      for(int a=0;a<data->n;a++){
-        AstNode* copy=copy_type((AstNode*)get_from_list(data,a));
-        add_to_list(ls,copy);
-      }
-      return new_node(AST_TYPE_TUPLE,-1,ls);
-    }
-    case AST_TYPE_FUNC:{
-      AstListNode* data=(AstListNode*)(node->data);
-      List* ls=new_default_list();
-      for(int a=0;a<data->list->n;a++){
-        AstNode* e=copy_type((AstNode*)get_from_list(data->list,a));
-        add_to_list(ls,e);
-      }
-      return new_node(AST_TYPE_FUNC,-1,new_ast_list_node(copy_type(data->node),ls));
-    }
+static void clear_matches(){
+  for(int a=0;a<matches->n;a++) free(matches->data[a].k);
+  dealloc_map(matches);
+  matches=new_default_map();
+}
+
+/*
+  Empties the entity hierarchy index
+*/
+static void clear_hierarchy(){
+  for(int a=0;a<hierarchy->n;a++){
+    HierarchyNode* node=(HierarchyNode*)iterate_from_map(hierarchy,a);
+    dealloc_list(node->implementations);
+    dealloc_list(node->children);
+    free(node->implemented);
+    free(node);
   }
+  dealloc_map(hierarchy);
+  hierarchy=new_default_map();
+}
+
+/*
+  Deallocate registers and equivalence graphs
+*/
+void dealloc_types(){
+  // Quelling scoped type equivalences means there shouldn't be
+  // any equivalences left by the time we get here
+  assert(types_edges->n==0);
+  for(int a=0;a<types_graph->n;a++) dealloc_list((List*)iterate_from_map(types_graph,a));
+  dealloc_map(types_graph);
+  dealloc_list(types_edges);
+  clear_reachable();
+  dealloc_map(reachable);
+  clear_hierarchy();
+  dealloc_map(hierarchy);
+  clear_matches();
+  dealloc_map(matches);
 }
 
 /*
@@ -62,75 +96,49 @@ int is_primitive(AstNode* node,const char* type){
   node is either a ClassNode or InterfaceNode, as specified by is_interface
 */
 static AstNode* get_type_of_field(char* name,void* data,int is_interface){
-  AstNode* node=new_node(is_interface?AST_INTERFACE:AST_CLASS,-1,data);
-  List* body=get_all_expected_fields(node);
-  free(node);
-  for(int a=0;a<body->n;a++){
-    AstNode* e=(AstNode*)get_from_list(body,a);
-    if(e->type==AST_FUNCTION){
-      FunctionNode* func=(FunctionNode*)(e->data);
-      if(func->name){
-        char* funcname=(char*)(func->name->data);
-        if(!strcmp(funcname,name)) return get_type(e);
-      }
-    }else{
-      BinaryNode* def=(BinaryNode*)(e->data);
-      if(!strcmp(def->text,name)) return def->l;
-    }
-  }
-  return NULL;
+  Map* members=is_interface?get_interface_members((InterfaceNode*)data):get_class_members((ClassNode*)data);
+  MemberNode* member=(MemberNode*)get_from_map(members,name);
+  return member?member->type:NULL;
 }
 
 // Functions for getting type nodes from various AstNodes
-static AstNode* get_ltuple_type(AstListNode* data){
-  if(!data->node){
-    List* ls=data->list;
-    List* types=new_default_list();
-    for(int a=0;a<ls->n;a++){
-      AstNode* e=(AstNode*)get_from_list(ls,a);
-      add_to_list(types,copy_type(get_type(e)));
-    }
-    data->node=new_node(AST_TYPE_TUPLE,-1,types);
-  }
-  return data->node;
-}
-static AstNode* get_tuple_type(AstListNode* data){
+static AstNode* get_tuple_type(AstNode* node){
+  AstListNode* data=(AstListNode*)(node->data);
   if(!data->node){
     List* ls=data->list;
     List* types=new_default_list();
     for(int a=0;a<ls->n;a++){
       AstNode* e=(AstNode*)get_from_list(ls,a);
-      add_to_list(types,copy_type(get_type(e)));
+      add_to_list(types,get_type(e));
     }
-    data->node=new_node(AST_TYPE_TUPLE,-1,types);
+    data->node=new_tuple_type(types);
   }
   return data->node;
 }
-static AstNode* get_function_type(FunctionNode* data){
+AstNode* get_function_type(FunctionNode* data){
   if(!data->functype){
     List* ls=new_default_list();
     for(int a=0;a<data->args->n;a++){
       AstNode* e;
       StringAstNode* arg=(StringAstNode*)get_from_list(data->args,a);
-      if(arg->node) e=copy_type(arg->node);
-      else if(!strcmp(arg->text,"...")) e=new_node(AST_TYPE_VARARG,-1,NULL);
-      else e=new_node(AST_TYPE_ANY,-1,NULL);
+      if(arg->node) e=arg->node;
+      else if(!strcmp(arg->text,"...")) e=new_vararg_type();
+      else e=new_any_type();
       add_to_list(ls,e);
     }
-    data->functype=new_node(AST_TYPE_FUNC,-1,new_ast_list_node(copy_type(data->type),ls));
+    data->functype=new_function_type(data->type,ls);
   }
   return data->functype;
 }
-static AstNode* get_super_type(){
+static AstNode* get_super_type(AstNode* node){
+  (void)node; // A super call returns whatever the method it's in returns
   FunctionNode* method=get_method_scope();
   if(!method) return any_type_const();
-  AstNode* node=new_node(AST_FUNCTION,-1,method);
-  AstListNode* functype=(AstListNode*)(get_type(node)->data);
-  free(node);
+  AstListNode* functype=(AstListNode*)(get_function_type(method)->data);
   return functype->node;
 }
-static AstNode* get_call_type(AstAstNode* data){
-  AstNode* l=data->l;
+static AstNode* get_call_type(AstNode* node){
+  AstNode* l=((AstAstNode*)(node->data))->l;
   if(l->type==AST_ID){
     char* name=(char*)(l->data);
     FunctionNode* func=function_exists(name);
@@ -148,7 +156,8 @@ static AstNode* get_id_type(AstNode* node){
   StringAstNode* var=get_scoped_var(name);
   return (var && var->node)?(var->node):any_type_const();
 }
-static AstNode* get_field_type(StringAstNode* data){
+static AstNode* get_field_type(AstNode* node){
+  StringAstNode* data=(StringAstNode*)(node->data);
   AstNode* ltype=get_type(data->node);
   if(ltype->type==AST_TYPE_BASIC){
     char* name=(char*)(ltype->data);
@@ -156,20 +165,21 @@ static AstNode* get_field_type(StringAstNode* data){
     if(inode){
       AstNode* type=get_type_of_field(data->text,inode,1);
       if(type) return type;
-      add_error(-1,"interface %s has no such field %s",inode->name,data->text);
+      add_error(-1,-1,"interface %s has no such field %s",inode->name,data->text);
       return any_type_const();
     }
     ClassNode* cnode=class_exists(name);
     if(cnode){
       AstNode* type=get_type_of_field(data->text,cnode,0);
       if(type) return type;
-      add_error(-1,"class %s has no such field %s",cnode->name,data->text);
+      add_error(-1,-1,"class %s has no such field %s",cnode->name,data->text);
       return any_type_const();
     }
   }
   return any_type_const();
 }
-static AstNode* get_binary_type(BinaryNode* data){
+static AstNode* get_binary_type(AstNode* node){
+  BinaryNode* data=(BinaryNode*)(node->data);
   if(!strcmp(data->text,"as")){
     return data->r;
   }
@@ -190,29 +200,77 @@ static AstNode* get_binary_type(BinaryNode* data){
   return bool_type_const();
 }
 
+static AstNode* get_function_node_type(AstNode* node){
+  return get_function_type((FunctionNode*)(node->data));
+}
+static AstNode* get_primitive_type(AstNode* node){
+  return ((StringAstNode*)(node->data))->node;
+}
+static AstNode* get_paren_type(AstNode* node){
+  return get_type((AstNode*)(node->data));
+}
+static AstNode* get_define_type(AstNode* node){
+  return ((BinaryNode*)(node->data))->l;
+}
+static AstNode* get_unary_type(AstNode* node){
+  return ((BinaryNode*)(node->data))->r;
+}
+
+/*
+  Type functions for each AstNode type
+  Types in cached_type_handlers depend on the current scope and are memoized
+  Node types with no entry in either table have the ANY type
+*/
+typedef AstNode* (*TypeHandler)(AstNode* node);
+static const TypeHandler type_handlers[NUM_RULES]={
+  [AST_FUNCTION]=get_function_node_type,
+  [AST_PRIMITIVE]=get_primitive_type,
+  [AST_LTUPLE]=get_tuple_type,
+  [AST_DEFINE]=get_define_type,
+  [AST_UNARY]=get_unary_type,
+  [AST_TUPLE]=get_tuple_type
+};
+static const TypeHandler cached_type_handlers[NUM_RULES]={
+  [AST_BINARY]=get_binary_type,
+  [AST_FIELD]=get_field_type,
+  [AST_PAREN]=get_paren_type,
+  [AST_SUPER]=get_super_type,
+  [AST_CALL]=get_call_type,
+  [AST_ID]=get_id_type
+};
+
+/*
+  Invalidates every expression type memoized by get_type
+  Called whenever scoped variables, registered entities or type equivalences change
+*/
+void invalidate_cached_types(){
+  types_epoch++;
+}
+
+/*
+  Computes the type of an AstNode whose type depends on its scope
+  Results are memoized on the node until the types epoch changes
+  Results are not memoized if computing them reported an error
+*/
+static AstNode* get_cached_type(AstNode* node){
+  if(node->type_epoch==types_epoch) return node->cached_type;
+  int errors=moonshot_num_errors();
+  AstNode* type=cached_type_handlers[node->type](node);
+  if(errors==moonshot_num_errors()){
+    node->type_epoch=types_epoch;
+    node->cached_type=type;
+  }
+  return type;
+}
+
 /*
   Finds an AST_TYPE_* AstNode for the input AstNode
   Never free the result of this function, it will be deallocated elsewhere
 */
 AstNode* get_type(AstNode* node){
-  int type=node->type;
-  switch(node->type){
-    case AST_FUNCTION: return get_function_type((FunctionNode*)(node->data));
-    case AST_FIELD: return get_field_type((StringAstNode*)(node->data));
-    case AST_LTUPLE: return get_ltuple_type((AstListNode*)(node->data));
-    case AST_BINARY: return get_binary_type((BinaryNode*)(node->data));
-    case AST_TUPLE: return get_tuple_type((AstListNode*)(node->data));
-    case AST_PRIMITIVE: return ((StringAstNode*)(node->data))->node;
-    case AST_CALL: return get_call_type((AstAstNode*)(node->data));
-    case AST_PAREN: return get_type((AstNode*)(node->data));
-    case AST_DEFINE: return ((BinaryNode*)(node->data))->l;
-    case AST_UNARY: return ((BinaryNode*)(node->data))->r;
-    case AST_REQUIRE: return any_type_const();
-    case AST_SUPER: return get_super_type();
-    case AST_SUB: return any_type_const();
-    case AST_ID: return get_id_type(node);
-    default: return any_type_const();
-  }
+  if(cached_type_handlers[node->type]) return get_cached_type(node);
+  if(type_handlers[node->type]) return type_handlers[node->type](node);
+  return any_type_const();
 }
 
 /*
@@ -231,11 +289,10 @@ int is_variadic_function(List* args){
 static int typed_match_no_equivalence(AstNode* l,AstNode* r){
   if(l->type==AST_TYPE_ANY) return 1;
   if(!r) return 0;
+  if(l==r) return l->type!=AST_TYPE_VARARG; // Type nodes are canonical
   if(is_primitive(r,PRIMITIVE_NIL)) return 1;
   if(is_primitive(l,PRIMITIVE_FLOAT) && is_primitive(r,PRIMITIVE_INT)) return 1;
-  if(l->type==AST_TYPE_BASIC && r->type==AST_TYPE_BASIC){
-    return !strcmp((char*)(l->data),(char*)(r->data));
-  }
+  if(l->type==AST_TYPE_BASIC && r->type==AST_TYPE_BASIC) return 0;
   if(l->type==AST_TYPE_TUPLE && r->type==AST_TYPE_TUPLE){
     List* lls=(List*)(l->data);
     List* rls=(List*)(r->data);
@@ -273,8 +330,23 @@ static int typed_match_no_equivalence(AstNode* l,AstNode* r){
 */
 int typed_match(AstNode* l,AstNode* r){
   if(!l) return 1;
-  if(r && l->type==AST_TYPE_BASIC && types_equivalent((char*)(l->data),r)) return 1;
-  return typed_match_no_equivalence(l,r);
+  if(matches_generation!=graph_generation){
+    clear_matches();
+    matches_generation=graph_generation;
+  }
+  char key[40];
+  sprintf(key,"%p,%p",(void*)l,(void*)r);
+  void* memo=get_from_map(matches,key);
+  if(memo){
+    match_hits++;
+    return (long)memo-1;
+  }
+  match_misses++;
+  int result=(r && l->type==AST_TYPE_BASIC && types_equivalent((char*)(l->data),r)) || typed_match_no_equivalence(l,r);
+  char* k=(char*)malloc(sizeof(char)*(strlen(key)+1));
+  strcpy(k,key);
+  put_in_map(matches,k,(void*)(long)(result+1));
+  return result;
 }
 
 /*
@@ -282,15 +354,18 @@ int typed_match(AstNode* l,AstNode* r){
   Returns the input type if it is already at its lowest typedef link
 */
 char* base_type(char* name){
-  while(1){
-    for(int a=0;a<types_graph->n;a++){
-      EqualTypesNode* node=(EqualTypesNode*)get_from_list(types_graph,a);
-      if(node->relation==RL_EQUALS && node->type->type==AST_TYPE_BASIC && !strcmp(node->name,name)){
+  int found=1;
+  while(found){
+    found=0;
+    List* ls=(List*)get_from_map(types_graph,name);
+    for(int a=0;ls && a<ls->n;a++){
+      EqualTypesNode* node=(EqualTypesNode*)get_from_list(ls,a);
+      if(node->relation==RL_EQUALS && node->type->type==AST_TYPE_BASIC){
         name=(char*)(node->type->data);
-        continue;
+        found=1;
+        break;
       }
     }
-    break;
   }
   return name;
 }
@@ -328,28 +403,160 @@ int compound_type_exists(AstNode* node){
   assert(0); // You should never get here
 }
 
+/*
+  Breadth-first search for a path from name to type in the equivalent types graph
+  Each type name is expanded at most once
+*/
+static int search_path(char* name,AstNode* type){
+  int found=0;
+  List* queue=new_default_list();
+  Map* visited=new_default_map();
+  put_in_map(visited,name,name);
+  add_to_list(queue,name);
+  for(int a=0;a<queue->n && !found;a++){
+    List* ls=(List*)get_from_map(types_graph,(char*)get_from_list(queue,a));
+    for(int b=0;ls && b<ls->n;b++){
+      AstNode* node=((EqualTypesNode*)get_from_list(ls,b))->type;
+      if(typed_match_no_equivalence(node,type)){
+        found=1;
+        break;
+      }
+      if(node->type==AST_TYPE_BASIC && !get_from_map(visited,(char*)(node->data))){
+        put_in_map(visited,(char*)(node->data),node->data);
+        add_to_list(queue,node->data);
+      }
+    }
+  }
+  dealloc_map(visited);
+  dealloc_list(queue);
+  return found;
+}
+
 /*
   Checks for a path from name to type in the equivalent types graph
+  Results for basic types are memoized until the graph changes
   Returns 1 if such a path exists
 */
 static int path_exists(char* name,AstNode* type){
-  List* ls=get_equivalent_types(name);
-  int a=0;
-  while(a<ls->n){
-    AstNode* node=get_from_list(ls,a);
-    if(typed_match_no_equivalence(node,type)){
-      dealloc_list(ls);
-      return 1;
+  if(type->type!=AST_TYPE_BASIC) return search_path(name,type);
+  if(reachable_generation!=graph_generation){
+    clear_reachable();
+    reachable_generation=graph_generation;
+  }
+  Map* targets=(Map*)get_from_map(reachable,name);
+  if(!targets){
+    targets=new_default_map();
+    put_in_map(reachable,name,targets);
+  }
+  // Memoized results are stored as 1 (no path) or 2 (path) so they aren't mistaken for NULL
+  long result=(long)get_from_map(targets,(char*)(type->data));
+  if(!result){
+    result=search_path(name,type)+1;
+    put_in_map(targets,(char*)(type->data),(void*)result);
+  }
+  return result-1;
+}
+
+/*
+  Returns the HierarchyNode for an entity type name, creating it if necessary
+*/
+static HierarchyNode* hierarchy_node(char* name){
+  HierarchyNode* node=(HierarchyNode*)get_from_map(hierarchy,name);
+  if(!node){
+    node=(HierarchyNode*)malloc(sizeof(HierarchyNode));
+    node->implementations=new_default_list();
+    node->children=new_default_list();
+    node->implemented=NULL;
+    node->parent=NULL;
+    node->name=name;
+    node->pure=1;
+    node->pre=-1;
+    node->post=-1;
+    node->id=hierarchy->n;
+    put_in_map(hierarchy,name,node);
+  }
+  return node;
+}
+
+/*
+  Assigns pre and post-order numbers to an extends subtree
+  Also fills in implemented bitsets, which are inherited from a node's parent
+  order is the number of nodes visited so far
+*/
+static int number_hierarchy(HierarchyNode* node,int order,int bytes){
+  node->implemented=(unsigned char*)calloc(bytes,sizeof(unsigned char));
+  if(node->parent) memcpy(node->implemented,node->parent->implemented,bytes);
+  for(int a=0;a<node->implementations->n;a++){
+    HierarchyNode* e=(HierarchyNode*)get_from_list(node->implementations,a);
+    while(e){
+      node->implemented[e->id/8]|=1<<(e->id%8);
+      e=e->parent;
     }
-    if(node->type==AST_TYPE_BASIC){
-      List* ls1=get_equivalent_types((char*)(node->data));
-      for(int b=0;b<ls1->n;b++) add_to_list(ls,get_from_list(ls1,b));
-      dealloc_list(ls1);
+  }
+  node->pre=order++;
+  for(int a=0;a<node->children->n;a++){
+    order=number_hierarchy((HierarchyNode*)get_from_list(node->children,a),order,bytes);
+  }
+  node->post=order++;
+  return order;
+}
+
+/*
+  Indexes the class and interface hierarchy once the relate step has finished for a scope
+  RL_EXTENDS edges form a forest that gets numbered with pre/post-order intervals
+  RL_IMPLEMENTS edges are flattened into per-type bitsets
+  The index is only trusted until the next time the types graph changes, and isn't rebuilt before then
+*/
+void index_type_hierarchy(){
+  if(hierarchy_generation==graph_generation) return;
+  clear_hierarchy();
+  hierarchy_generation=-1;
+  for(int a=0;a<types_edges->n;a++){
+    EqualTypesNode* edge=(EqualTypesNode*)get_from_list(types_edges,a);
+    if(edge->relation==RL_EQUALS) continue;
+    assert(edge->type->type==AST_TYPE_BASIC); // Entity relations are always between basic types
+    HierarchyNode* parent=hierarchy_node(edge->name);
+    HierarchyNode* child=hierarchy_node((char*)(edge->type->data));
+    if(edge->relation==RL_EXTENDS){
+      if(child->parent || child==parent) return;
+      add_to_list(parent->children,child);
+      child->parent=parent;
+    }else{
+      add_to_list(child->implementations,parent);
     }
-    a++;
   }
-  dealloc_list(ls);
-  return 0;
+  for(int a=0;a<types_edges->n;a++){
+    EqualTypesNode* edge=(EqualTypesNode*)get_from_list(types_edges,a);
+    HierarchyNode* node=(HierarchyNode*)get_from_map(hierarchy,edge->name);
+    if(node && edge->relation==RL_EQUALS) node->pure=0;
+  }
+  int order=0;
+  int bytes=hierarchy->n/8+1;
+  for(int a=0;a<hierarchy->n;a++){
+    HierarchyNode* node=(HierarchyNode*)iterate_from_map(hierarchy,a);
+    if(!node->parent) order=number_hierarchy(node,order,bytes);
+  }
+  if(order<hierarchy->n*2) return; // Some nodes are unreachable from a root
+  hierarchy_generation=graph_generation;
+}
+
+/*
+  Answers a types_equivalent query from the entity hierarchy index
+  Returns 1 and writes the answer to result if the index can answer for these types
+  Returns 0 if the query has to fall back to a graph search
+*/
+static int hierarchy_subtype(char* name,AstNode* type,int* result){
+  if(hierarchy_generation!=graph_generation || type->type!=AST_TYPE_BASIC) return 0;
+  HierarchyNode* parent=(HierarchyNode*)get_from_map(hierarchy,name);
+  if(!parent || !parent->pure || is_primitive(type,PRIMITIVE_NIL)) return 0;
+  HierarchyNode* child=(HierarchyNode*)get_from_map(hierarchy,(char*)(type->data));
+  if(!child){
+    // Every type reachable from an entity is itself in the index
+    *result=0;
+    return 1;
+  }
+  *result=(child!=parent && parent->pre<=child->pre && child->post<=parent->post) || (child->implemented[parent->id/8]&(1<<(parent->id%8)));
+  return 1;
 }
 
 /*
@@ -357,8 +564,7 @@ static int path_exists(char* name,AstNode* type){
   Just a wrapper around add_type_equivalence
 */
 int add_child_type(char* child,char* parent,int relation){
-  AstNode* r=new_node(AST_TYPE_BASIC,-1,child);
-  return add_type_equivalence(parent,r,relation);
+  return add_type_equivalence(parent,new_basic_type(child),relation);
 }
 
 /*
@@ -368,14 +574,20 @@ int add_child_type(char* child,char* parent,int relation){
 */
 int add_type_equivalence(char* name,AstNode* type,int relation){
   if(type->type==AST_TYPE_BASIC){
-    AstNode* r=new_node(AST_TYPE_BASIC,-1,name);
     char* l=(char*)(type->data);
-    int cycle=path_exists(l,r);
-    free(r);
-    if(cycle) return 0;
+    if(path_exists(l,new_basic_type(name))) return 0;
   }
   assert(get_num_scopes()>0); // Ensure that there is a scope
-  add_to_list(types_graph,new_equal_types_node(name,type,relation,get_num_scopes()));
+  EqualTypesNode* edge=new_equal_types_node(name,type,relation,get_num_scopes());
+  List* ls=(List*)get_from_map(types_graph,name);
+  if(!ls){
+    ls=new_default_list();
+    put_in_map(types_graph,name,ls);
+  }
+  add_to_list(ls,edge);
+  add_to_list(types_edges,edge);
+  invalidate_cached_types();
+  graph_generation++;
   return 1;
 }
 
@@ -385,9 +597,9 @@ int add_type_equivalence(char* name,AstNode* type,int relation){
 */
 List* get_equivalent_types(char* name){
   List* ls=new_default_list();
-  for(int a=0;a<types_graph->n;a++){
-    EqualTypesNode* node=(EqualTypesNode*)get_from_list(types_graph,a);
-    if(!strcmp(node->name,name)) add_to_list(ls,node->type);
+  List* edges=(List*)get_from_map(types_graph,name);
+  for(int a=0;edges && a<edges->n;a++){
+    add_to_list(ls,((EqualTypesNode*)get_from_list(edges,a))->type);
   }
   return ls;
 }
@@ -396,57 +608,65 @@ List* get_equivalent_types(char* name){
   Returns 1 if two types are equivalent (or if type is a subtype of name)
 */
 int types_equivalent(char* name,AstNode* type){
+  int result;
   if(type->type==AST_TYPE_BASIC && !strcmp(name,(char*)(type->data))) return 1;
+  if(hierarchy_subtype(name,type,&result)) return result;
   return path_exists(name,type);
 }
 
 /*
   Cleans expired edges from the types equivalency graph
   Expired means we have exited the scope that an equivalence was defined in
+  Edges are added in scope order, so the expired edges are a segment at the
+  end of types_edges and at the end of each of their adjacency lists
 */
 void quell_expired_scope_equivalences(int scope){
-  int a=0;
-  while(a<types_graph->n){
-    EqualTypesNode* node=(EqualTypesNode*)get_from_list(types_graph,a);
+  int generation=graph_generation;
+  while(types_edges->n){
+    EqualTypesNode* node=(EqualTypesNode*)get_from_list(types_edges,types_edges->n-1);
     assert(node->scope<=scope);
-    if(node->scope==scope){
-      remove_from_list(types_graph,a);
-    }else{
-      a++;
-    }
+    if(node->scope!=scope) break;
+    List* ls=(List*)get_from_map(types_graph,node->name);
+    assert(get_from_list(ls,ls->n-1)==node);
+    remove_from_list(ls,ls->n-1);
+    remove_from_list(types_edges,types_edges->n-1);
+    invalidate_cached_types();
+    graph_generation++;
+    free(node);
   }
+  if(generation!=graph_generation) index_type_hierarchy();
 }
 
 /*
-  Internal recursive function that helps with type stringification
+  Appends the string representation of a AST_TYPE_* AstNode to a Buffer
 */
-static void stringify_type_internal(List* ls,AstNode* node){
+void stringify_type_to_buffer(Buffer* b,AstNode* node){
   if(!node || node->type==AST_TYPE_ANY){
-    add_to_list(ls,"var");
+    append_string_to_buffer(b,"var");
   }else if(node->type==AST_TYPE_VARARG){
-    add_to_list(ls,"...");
+    append_string_to_buffer(b,"...");
   }else if(node->type==AST_TYPE_BASIC){
-    add_to_list(ls,node->data);
+    append_string_to_buffer(b,(char*)(node->data));
   }else if(node->type==AST_TYPE_TUPLE){
     List* tls=(List*)(node->data);
-    add_to_list(ls,"(");
+    append_string_to_buffer(b,"(");
     for(int a=0;a<tls->n;a++){
-      if(a) add_to_list(ls,",");
-      stringify_type_internal(ls,(AstNode*)get_from_list(tls,a));
+      if(a) append_string_to_buffer(b,",");
+      stringify_type_to_buffer(b,(AstNode*)get_from_list(tls,a));
     }
-    add_to_list(ls,")");
+    append_string_to_buffer(b,")");
   }else if(node->type==AST_TYPE_FUNC){
     AstListNode* data=(AstListNode*)(node->data);
-    if(ls->n==0 || strcmp((char*)get_from_list(ls,ls->n-1),"*")){
-      add_to_list(ls,"*");
+    if(!b->n || b->data[b->n-1]!='*'){
+      append_string_to_buffer(b,"*");
     }
-    stringify_type_internal(ls,data->node);
-    add_to_list(ls,"(");
+    stringify_type_to_buffer(b,data->node);
+    append_string_to_buffer(b,"(");
     for(int a=0;a<data->list->n;a++){
-      if(a) add_to_list(ls,",");
-      stringify_type_internal(ls,(AstNode*)get_from_list(data->list,a));
+      if(a) append_string_to_buffer(b,",");
+      stringify_type_to_buffer(b,(AstNode*)get_from_list(data->list,a));
     }
-    add_to_list(ls,")");
+    append_string_to_buffer(b,")");
   }
 }
 
@@ -455,25 +675,29 @@ static void stringify_type_internal(List* ls,AstNode* node){
   Very helpful for error formatting and debugging
 */
 char* stringify_type(AstNode* node){
-  int len=1;
-  List* ls=new_default_list();
-  stringify_type_internal(ls,node);
-  for(int a=0;a<ls->n;a++) len+=strlen((char*)get_from_list(ls,a));
-  char* type=(char*)malloc(sizeof(char)+len);
-  type[0]=0;
-  for(int a=0;a<ls->n;a++) strcat(type,(char*)get_from_list(ls,a));
-  dealloc_list(ls);
-  return type;
+  Buffer* b=new_default_buffer();
+  stringify_type_to_buffer(b,node);
+  return collapse_buffer(b);
 }
 
 /*
   Print out types equivalence graph
 */
 void print_types_graph(){
-  for(int a=0;a<types_graph->n;a++){
-    EqualTypesNode* e=(EqualTypesNode*)get_from_list(types_graph,a);
+  for(int a=0;a<types_edges->n;a++){
+    EqualTypesNode* e=(EqualTypesNode*)get_from_list(types_edges,a);
     char* type=stringify_type(e->type);
     printf("%i: %s -> %s\n",e->relation,e->name,type);
     free(type);
   }
 }
+
+/*
+  Get how often typed_match was answered by its cache (hits) or had to walk the types graph (misses)
+*/
+int num_typed_match_hits(){
+  return match_hits;
+}
+int num_typed_match_misses(){
+  return match_misses;
+}
@@ -1,5 +1,6 @@
 #include "../src/moonshot.h"
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 // Output
@@ -20,12 +21,71 @@ static void help(){
   indent(2,"Print Moonshot version\n");
   indent(1,"--print");
   indent(3,"Write Lua code to stdout\n");
+  indent(1,"--metatable-classes\n");
+  indent(7,"Share class methods through metatables\n");
+  indent(7,"Untyped values pass the instance to methods themselves, as in v.get(v)\n");
+  indent(1,"--hoist-globals\n");
+  indent(7,"Read standard library globals through locals\n");
+  indent(1,"--no-inline");
+  indent(2,"Keep calls to small functions and final methods\n");
+  indent(1,"--max-errors <n>");
+  indent(1,"Stop compiling after n errors\n");
+  indent(1,"--diagnostics-format=<text|json>\n");
+  indent(7,"Print errors as text or as one JSON object per line\n");
+  indent(1,"--stats");
+  indent(3,"Print dead code and type cache statistics to stderr\n");
   indent(1,"--help");
   indent(3," Print usage options\n");
 }
 
+// Machine-readable output
+static void json_string(const char* str){
+  if(!str){
+    printf("null");
+    return;
+  }
+  putchar('"');
+  for(;*str;str++){
+    if(*str=='"' || *str=='\\') printf("\\%c",*str);
+    else if(*str=='\n') printf("\\n");
+    else if(*str=='\t') printf("\\t");
+    else if((unsigned char)(*str)<0x20) printf("\\u%04x",*str);
+    else putchar(*str);
+  }
+  putchar('"');
+}
+static void json_diagnostics(){
+  int n;
+  MoonshotDiagnostic* ds=moonshot_diagnostics(&n);
+  for(int a=0;a<n;a++){
+    printf("{\"severity\":");
+    json_string(ds[a].severity);
+    printf(",\"file\":");
+    json_string(ds[a].file);
+    printf(",\"line\":%i,\"column\":%i,\"id\":\"%08x\",\"message\":",ds[a].line,ds[a].column,ds[a].id);
+    json_string(ds[a].message);
+    printf("}\n");
+  }
+}
+
 // Argument parsing
-static int check_args(FILE** output,char** source,int argc,char** argv,int a){
+static int check_args(FILE** output,char** source,int* max_errors,int* json,int* stats,int argc,char** argv,int a){
+  if(!strcmp(argv[a],"--metatable-classes")){
+    moonshot_set_option(OPTION_METATABLE_CLASSES,1);
+    return 0;
+  }
+  if(!strcmp(argv[a],"--hoist-globals")){
+    moonshot_set_option(OPTION_HOIST_GLOBALS,1);
+    return 0;
+  }
+  if(!strcmp(argv[a],"--no-inline")){
+    moonshot_set_option(OPTION_INLINE_CALLS,0);
+    return 0;
+  }
+  if(!strcmp(argv[a],"--stats")){
+    *stats=1;
+    return 0;
+  }
   if(!strcmp(argv[a],"--version")){
     printf("Moonshot v%s\n",VERSION);
     return 2;
@@ -52,6 +112,18 @@ static int check_args(FILE** output,char** source,int argc,char** argv,int a){
       return 1;
     }
     *output=fopen(argv[a+1],"w");
+  }else if(!strcmp(argv[a],"--max-errors")){
+    if(a==argc-1 || atoi(argv[a+1])<1){
+      help();
+      return 1;
+    }
+    *max_errors=atoi(argv[a+1]);
+  }else if(!strncmp(argv[a],"--diagnostics-format=",21)){
+    if(strcmp(argv[a]+21,"json") && strcmp(argv[a]+21,"text")){
+      help();
+      return 1;
+    }
+    *json=!strcmp(argv[a]+21,"json");
   }else{
     if(a<argc-1){
       help();
@@ -66,15 +138,19 @@ int main(int argc,char** argv){
   char* source=NULL;
   FILE* output=NULL;
   FILE* input=NULL;
+  int max_errors=0;
+  int stats=0;
+  int json=0;
 
   // Parse arguments
+  moonshot_init();
   for(int a=1;a<argc;a++){
-    int res=check_args(&output,&source,argc,argv,a);
+    int res=check_args(&output,&source,&max_errors,&json,&stats,argc,argv,a);
     if(res){
       if(output && output!=stdout) fclose(output);
       return res%2;
     }
-    if(!strcmp(argv[a],"-o")) a++;
+    if(!strcmp(argv[a],"-o") || !strcmp(argv[a],"--max-errors")) a++;
   }
 
   // Validate I/O arguments
@@ -99,17 +175,26 @@ int main(int argc,char** argv){
   }
 
   // Compile
-  moonshot_init();
   moonshot_configure(input,output);
+  moonshot_set_max_errors(max_errors);
   init_requires();
   dummy_required_file(source);
   moonshot_compile();
   int n=moonshot_num_errors();
-  if(n==1) printf("Moonshot compiler returned 1 error\n");
-  if(n>1) printf("Moonshot compiler returned %i errors\n",n);
-  for(int a=0;a<n;a++){
-    error();
-    printf("%s\n",moonshot_next_error());
+  if(json){
+    json_diagnostics();
+  }else{
+    if(n==1) printf("Moonshot compiler returned 1 error\n");
+    if(n>1) printf("Moonshot compiler returned %i errors\n",n);
+    for(int a=0;a<n;a++){
+      error();
+      printf("%s\n",moonshot_next_error());
+    }
+  }
+  if(stats && !n){
+    MoonshotStats s=moonshot_stats();
+    fprintf(stderr,"Removed %i unreachable statements, %i constant branches and %i unused locals\n",s.unreachable_statements,s.constant_branches,s.unused_locals);
+    fprintf(stderr,"Answered %i of %i type comparisons from the cache\n",s.type_match_hits,s.type_match_hits+s.type_match_misses);
   }
   if(output!=stdout) fclose(output);
   if(input!=stdin) fclose(input);